@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# This software is released as-is into the public domain, as described at
+# https://unlicense.org. Do whatever you like with it.
+
+# Run standard mem workloads against anonymous memory and report their throughput, so regressions in
+# the parsing, mapping, access and output paths show up without root or hardware. Each workload is a
+# separate run of mem on a fresh memfd, and the time includes starting mem.
+#
+# Usage: bench.sh [mem], MEM_SIZE sets the memfd size in bytes, default 1 GiB.
+
+set -e -o pipefail
+
+mem=${1:-./mem}
+size=$((${MEM_SIZE:-1 << 30}))
+words=$((size / 4))
+ops=10000
+
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+# bench name count units mem-arguments..., run mem with its output discarded and print count/second
+bench()
+{
+    local name=$1 count=$2 units=$3
+    shift 3
+    local start=$(date +%s%N)
+    "$mem" -D memfd:$size "$@" > /dev/null
+    local end=$(date +%s%N)
+    awk -v n="$name" -v c=$count -v u="$units" -v ns=$((end - start)) \
+        'BEGIN { printf "%-12s %14.0f %s/s %10.3f s\n", n, c * 1e9 / ns, u, ns / 1e9 }'
+}
+
+for ((n = 0; n < ops; n++)); do echo "$((n * 4))=$n"; done > $tmp/pokes
+for ((n = 0; n < ops; n++)); do echo "$((n * 4))"; done > $tmp/peeks
+for ((n = 0; n < ops; n++)); do echo "$((n * 4))?0xFF==0"; done > $tmp/polls
+for ((n = 0; n < ops; n++)); do a=$((n * 4)); echo "$a|=0xF0 $a&=0x3C $a^=0x5A $a[7:4]=3"; done > $tmp/rmw
+
+bench pokes $ops ops -f $tmp/pokes
+bench peeks $ops ops -f $tmp/peeks
+bench polls $ops ops -f $tmp/polls
+bench rmw $((ops * 4)) ops -f $tmp/rmw
+bench batch $ops ops -f <(echo "["; cat $tmp/pokes; echo "]")
+bench fill $((size >> 20)) MiB 0:$words=0x5A5A5A5A
+bench read $((size >> 20)) MiB r 0:$words
+bench hex $((size >> 24)) MiB 0:$((words >> 4))
+bench crc $((size >> 20)) MiB crc:0:$words
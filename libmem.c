@@ -0,0 +1,621 @@
+// This software is released as-is into the public domain, as described at
+// https://unlicense.org. Do whatever you like with it.
+
+// See https://github.com/glitchub/mem for more information.
+
+#define _GNU_SOURCE
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmem.h"
+
+// Mapping cache, most recently used first. Accesses that hit an existing window don't touch the
+// kernel at all, and a miss adjacent to a cached window is merged with it into one larger window
+// (up to MAXCOALESCE bytes), so a sweep across consecutive pages settles into a single mapping.
+#define MAXMAPS 8
+#define MAXCOALESCE (1 << 20)
+
+// Bounded devices up to this size are mapped whole on first access
+#define MAXWHOLE (1 << 28)
+
+// Requests of at least MINPOPULATE bytes are pre-faulted, windows of at least HUGE bytes are placed
+// for huge pages
+#define MINPOPULATE (1 << 16)
+#define HUGE (1 << 21)
+
+struct mem
+{
+    char *device;
+    int fd[2]; // device opened with and without O_SYNC, the latter on demand
+    int port; // /dev/port, accessed with pread() and pwrite() instead of mapped
+    uint64_t offset; // device offset of address 0
+    uint64_t size; // size of a bounded device, or 0
+    uint8_t *snapshot; // a snapshot file, mapped private
+    uint64_t snapsize;
+    struct region { struct mem_region r; uint64_t order; } *regions; // sorted by address, then order in the file
+    uint64_t nregions;
+    struct mem_stats stats;
+    int clone; // the snapshot and regions belong to the handle this was cloned from
+    int maps;
+    struct
+    {
+        uint64_t base; // page-aligned physical address
+        uint64_t size; // mapped bytes, a multiple of the page size
+        int cached;
+        void *map;
+    } map[MAXMAPS];
+};
+
+// Return a hex number from a sysfs file, or 0
+static uint64_t sysfs(const char *format, unsigned a, unsigned b)
+{
+    char name[80];
+    unsigned long long value = 0;
+    snprintf(name, sizeof(name), format, a, b);
+    FILE *f = fopen(name, "r");
+    if (f)
+    {
+        if (fscanf(f, "%llx", &value) != 1) value = 0;
+        fclose(f);
+    }
+    return value;
+}
+
+static int byaddress(const void *a, const void *b)
+{
+    const struct region *x = a, *y = b;
+    if (x->r.address != y->r.address) return (x->r.address > y->r.address) - (x->r.address < y->r.address);
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// Return true if the region's width and length suit its opcode
+static int valid(const struct mem_region *r)
+{
+    if (r->opcode == MEM_FENCE) return !r->length;
+    if (r->width < 8 || r->width > 256 || (r->width & (r->width - 1))) return 0;
+    switch (r->opcode)
+    {
+        case MEM_READ:
+        case MEM_WRITE:
+            return !(r->length % (r->width/8));
+        case MEM_AND:
+        case MEM_OR:
+        case MEM_XOR:
+            return r->length == 8 && r->count && r->width <= 64;
+        case MEM_FIELD:
+            return r->length == 16 && r->count && r->width <= 64;
+    }
+    return 0;
+}
+
+const struct mem_region *mem_table(const void *snapshot, uint64_t size, uint64_t *regions)
+{
+    const uint8_t *p = snapshot;
+    struct mem_trailer t;
+    if (size < MEM_SNAPSHOT_HEADER + sizeof(t) || memcmp(p, MEM_SNAPSHOT_MAGIC, 8)) return NULL;
+    memcpy(&t, p + size - sizeof(t), sizeof(t));
+    uint64_t end = size - sizeof(t);
+    if (memcmp(t.magic, MEM_SNAPSHOT_MAGIC, 8) || t.table > end || t.table % MEM_SNAPSHOT_HEADER ||
+        t.regions > (end - t.table) / sizeof(struct mem_region)) return NULL;
+    const struct mem_region *table = (const struct mem_region *)(p + t.table);
+    for (uint64_t n = 0; n < t.regions; n++)
+        if (table[n].offset > t.table || table[n].length > t.table - table[n].offset || !valid(&table[n])) return NULL;
+    *regions = t.regions;
+    return table;
+}
+
+// If the open file is a snapshot, map it and load its region table. Return 0 if it's a snapshot or
+// not, -1 if it's an invalid one.
+static int snapshot(struct mem *m, uint64_t size)
+{
+    char magic[8];
+    if (size < MEM_SNAPSHOT_HEADER + sizeof(struct mem_trailer) || pread(m->fd[0], magic, 8, 0) != 8 ||
+        memcmp(magic, MEM_SNAPSHOT_MAGIC, 8)) return 0;
+
+    uint8_t *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, m->fd[0], 0);
+    if (p == MAP_FAILED) return -1;
+    uint64_t count;
+    const struct mem_region *table = mem_table(p, size, &count);
+    if (!table) goto invalid;
+    m->regions = malloc(count * sizeof(struct region) + 1);
+    if (!m->regions) goto fail;
+    for (uint64_t n = 0; n < count; n++)
+        if (table[n].opcode == MEM_READ)
+        {
+            m->regions[m->nregions] = (struct region){ table[n], m->nregions };
+            m->nregions++;
+        }
+    // so the region found for an address is the last one captured with the highest base
+    qsort(m->regions, m->nregions, sizeof(struct region), byaddress);
+    m->snapshot = p;
+    m->snapsize = size;
+    m->size = 0;
+    return 0;
+
+    invalid:
+    errno = EINVAL;
+    fail:;
+    int e = errno;
+    free(m->regions);
+    m->regions = NULL;
+    m->nregions = 0;
+    munmap(p, size);
+    errno = e;
+    return -1;
+}
+
+// Return a pointer to size bytes at the address in the snapshot, from the region with the highest
+// base that contains them all, or NULL
+static void *lookup(struct mem *m, uint64_t address, uint64_t size)
+{
+    // binary search for the last region based at or below the address
+    uint64_t lo = 0, hi = m->nregions;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (m->regions[mid].r.address <= address) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo--)
+    {
+        struct mem_region *r = &m->regions[lo].r;
+        if (address - r->address < r->length && size <= r->length - (address - r->address))
+            return m->snapshot + r->offset + (address - r->address);
+    }
+    errno = EFAULT;
+    return NULL;
+}
+
+struct mem *mem_open(const char *device)
+{
+    struct mem *m = calloc(1, sizeof(struct mem));
+    if (!m) return NULL;
+    m->device = strdup(device ? device : "/dev/mem");
+    m->fd[0] = m->fd[1] = -1;
+    if (!m->device) goto fail;
+
+    // a UIO device is "/dev/uioN", or "/dev/uioN:M" for map M
+    unsigned uio, map = 0;
+    char c;
+    if (sscanf(m->device, "/dev/uio%u%c", &uio, &c) == 1 || sscanf(m->device, "/dev/uio%u:%u%c", &uio, &map, &c) == 2)
+    {
+        char *colon = strchr(m->device + 8, ':');
+        if (colon) *colon = 0;
+        m->size = sysfs("/sys/class/uio/uio%u/maps/map%u/size", uio, map);
+        if (!m->size)
+        {
+            errno = ENOENT;
+            goto fail;
+        }
+        // UIO selects the map with the mmap offset, the region may start part way into the page
+        m->offset = map * (uint64_t)getpagesize() + sysfs("/sys/class/uio/uio%u/maps/map%u/offset", uio, map);
+    }
+
+    // "memfd:size" is that many bytes of anonymous memory, initially zero, for testing and benchmarking
+    // without hardware. The cached descriptor is the same one.
+    if (!strncmp(m->device, "memfd:", 6))
+    {
+        char *end;
+        m->size = strtoull(m->device + 6, &end, 0);
+        if (!m->size || *end)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        m->fd[0] = memfd_create(m->device, 0);
+        if (m->fd[0] < 0 || ftruncate(m->fd[0], m->size) || (m->fd[1] = dup(m->fd[0])) < 0) goto fail;
+        return m;
+    }
+
+    m->fd[0] = open(m->device, O_RDWR|O_SYNC);
+    if (m->fd[0] < 0 && (errno == EACCES || errno == EROFS)) m->fd[0] = open(m->device, O_RDONLY); // maybe a snapshot
+    if (m->fd[0] < 0) goto fail;
+
+    struct stat st;
+    if (fstat(m->fd[0], &st)) goto fail;
+    if (S_ISREG(st.st_mode))
+    {
+        // including sysfs PCI resource files, which are the size of the BAR
+        m->size = st.st_size;
+        if (!m->size)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        if (snapshot(m, m->size)) goto fail;
+    }
+    m->port = !strcmp(m->device, "/dev/port");
+    return m;
+
+    fail:;
+    int e = errno;
+    if (m->fd[0] >= 0) close(m->fd[0]);
+    free(m->device);
+    free(m);
+    errno = e;
+    return NULL;
+}
+
+struct mem *mem_clone(struct mem *m)
+{
+    struct mem *c = malloc(sizeof(struct mem));
+    if (!c) return NULL;
+    *c = *m;
+    c->stats = (struct mem_stats){0};
+    c->clone = 1;
+    c->maps = 0;
+    c->fd[0] = c->fd[1] = -1;
+    if (!(c->device = strdup(m->device))) goto fail;
+    for (int n = 0; n < 2; n++) if (m->fd[n] >= 0 && (c->fd[n] = dup(m->fd[n])) < 0) goto fail;
+    return c;
+
+    fail:;
+    int e = errno;
+    mem_close(c);
+    errno = e;
+    return NULL;
+}
+
+void mem_close(struct mem *m)
+{
+    if (!m) return;
+    for (int n = 0; n < m->maps; n++) munmap(m->map[n].map, m->map[n].size);
+    for (int n = 0; n < 2; n++) if (m->fd[n] >= 0) close(m->fd[n]);
+    if (!m->clone)
+    {
+        if (m->snapshot) munmap(m->snapshot, m->snapsize);
+        free(m->regions);
+    }
+    free(m->device);
+    free(m);
+}
+
+int mem_mappable(struct mem *m)
+{
+    return !m->port;
+}
+
+uint64_t mem_size(struct mem *m)
+{
+    return m->size;
+}
+
+// Return monotonic nanoseconds
+static uint64_t nsec(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void mem_stats(struct mem *m, struct mem_stats *stats)
+{
+    *stats = m->stats;
+}
+
+// Unmap and forget window n
+static void unmap(struct mem *m, int n)
+{
+    uint64_t t = nsec();
+    munmap(m->map[n].map, m->map[n].size);
+    memmove(&m->map[n], &m->map[n + 1], (--m->maps - n) * sizeof(m->map[0]));
+    m->stats.unmaps++;
+    m->stats.unmapns += nsec() - t;
+}
+
+// Map len bytes of the descriptor from offset base. If len is at least HUGE, the virtual address is
+// congruent with base modulo HUGE, so the aligned interior of the window can use huge mappings where
+// the kernel and device support them, without mapping any more of the device. Return the
+// mapping or MAP_FAILED.
+static void *place(int fd, uint64_t base, uint64_t len, int populate)
+{
+    int flags = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+    if (len < HUGE) return mmap(NULL, len, PROT_READ|PROT_WRITE, flags, fd, (off_t)base);
+
+    // reserve enough address space to align the window, then map over it and trim the rest
+    uint8_t *r = mmap(NULL, len + HUGE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) return MAP_FAILED;
+    uint8_t *v = r + ((base - (uintptr_t)r) & (HUGE - 1));
+    void *p = mmap(v, len, PROT_READ|PROT_WRITE, flags|MAP_FIXED, fd, (off_t)base);
+    if (p == MAP_FAILED)
+    {
+        int e = errno;
+        munmap(r, len + HUGE);
+        errno = e;
+        return MAP_FAILED;
+    }
+    if (v > r) munmap(r, v - r);
+    if (r + len + HUGE > v + len) munmap(v + len, r + HUGE - v);
+    madvise(p, len, MADV_HUGEPAGE); // for files and memfds, pointless but harmless for devices
+    return p;
+}
+
+void *mem_map(struct mem *m, uint64_t address, uint64_t size, int flags)
+{
+    if (m->snapshot) return lookup(m, address, size);
+    if (m->port)
+    {
+        errno = ENODEV;
+        return NULL;
+    }
+    if (m->size && (address >= m->size || size > m->size - address))
+    {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    // from here on, address is the device offset
+    uint64_t start = address + m->offset;
+    uint64_t pagesize = getpagesize();
+    uint64_t base = start & ~(pagesize - 1);
+    uint64_t end = (start + size + pagesize - 1) & ~(pagesize - 1);
+    int cached = !!(flags & MEM_CACHED);
+    typeof(m->map[0]) *map = m->map;
+    address = start;
+
+    for (int n = 0; n < m->maps; n++)
+        if (map[n].cached == cached && map[n].base <= base && end <= map[n].base + map[n].size)
+        {
+            // hit, move it to the front
+            typeof(map[0]) hit = map[n];
+            memmove(&map[1], &map[0], n * sizeof(map[0]));
+            map[0] = hit;
+            m->stats.hits++;
+            return map[0].map + (address - hit.base);
+        }
+
+    // miss, absorb any windows that overlap or abut the requested range
+    for (int n = 0; n < m->maps;)
+    {
+        uint64_t b = (map[n].base < base) ? map[n].base : base;
+        uint64_t e = (map[n].base + map[n].size > end) ? map[n].base + map[n].size : end;
+        if (map[n].cached != cached || map[n].base > end || map[n].base + map[n].size < base || e - b > MAXCOALESCE)
+        {
+            n++;
+            continue;
+        }
+        unmap(m, n);
+        base = b;
+        end = e;
+        n = 0; // the window grew, start over
+    }
+
+    // a small enough bounded device is mapped whole, so it's only mapped once
+    if (m->size && m->size <= MAXWHOLE)
+    {
+        base = m->offset & ~(pagesize - 1);
+        end = (m->offset + m->size + pagesize - 1) & ~(pagesize - 1);
+    }
+
+    // evict the least recently used
+    if (m->maps == MAXMAPS) unmap(m, MAXMAPS - 1);
+
+    // cached mappings come from a second, non-O_SYNC descriptor so the kernel maps RAM write-back, or
+    // from the write-combining resourceN_wc file of a prefetchable PCI BAR
+    if (m->fd[cached] < 0)
+    {
+        if (cached && m->size && !strncmp(m->device, "/sys/", 5))
+        {
+            char wc[strlen(m->device) + 4];
+            strcat(strcpy(wc, m->device), "_wc");
+            m->fd[cached] = open(wc, O_RDWR);
+        }
+        if (m->fd[cached] < 0 && (m->fd[cached] = open(m->device, cached ? O_RDWR : O_RDWR|O_SYNC)) < 0) return NULL;
+    }
+
+    uint64_t t = nsec();
+    void *p = place(m->fd[cached], base, end - base, size >= MINPOPULATE);
+    if (p == MAP_FAILED) return NULL;
+    m->stats.maps++;
+    m->stats.mapns += nsec() - t;
+
+    memmove(&map[1], &map[0], m->maps++ * sizeof(map[0]));
+    map[0].base = base;
+    map[0].size = end - base;
+    map[0].cached = cached;
+    map[0].map = p;
+    return p + (address - base);
+}
+
+uint64_t mem_peek(const volatile void *address, int width)
+{
+    switch(width)
+    {
+        case  8: return *(volatile uint8_t *)  address;
+        case 16: return *(volatile uint16_t *) address;
+        case 32: return *(volatile uint32_t *) address;
+        default: return *(volatile uint64_t *) address;
+    }
+}
+
+void mem_poke(volatile void *address, int width, uint64_t data)
+{
+    switch(width)
+    {
+        case  8: *(volatile uint8_t *)  address = data; break;
+        case 16: *(volatile uint16_t *) address = data; break;
+        case 32: *(volatile uint32_t *) address = data; break;
+        default: *(volatile uint64_t *) address = data; break;
+    }
+}
+
+// 128- and 256-bit accesses use these vector types, which compile to single SSE2 or NEON loads and
+// stores on x86-64 and arm64 (elsewhere the compiler splits them into the widest available).
+typedef uint64_t v128 __attribute__((vector_size(16), aligned(1)));
+typedef uint64_t v256 __attribute__((vector_size(32), aligned(1)));
+
+static void copy128(volatile void *dst, const volatile void *src, uint64_t count)
+{
+    for (uint64_t n = 0; n < count; n++) ((volatile v128 *) dst)[n] = ((volatile v128 *) src)[n];
+}
+
+static void fill128(volatile void *dst, v128 data, uint64_t count)
+{
+    for (uint64_t n = 0; n < count; n++) ((volatile v128 *) dst)[n] = data;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 256-bit needs AVX, which has to be checked at runtime
+__attribute__((target("avx"))) static void copy256avx(volatile void *dst, const volatile void *src, uint64_t count)
+{
+    for (uint64_t n = 0; n < count; n++) ((volatile v256 *) dst)[n] = ((volatile v256 *) src)[n];
+}
+
+__attribute__((target("avx"))) static void fill256avx(volatile void *dst, const v256 *data, uint64_t count)
+{
+    v256 d = *data;
+    for (uint64_t n = 0; n < count; n++) ((volatile v256 *) dst)[n] = d;
+}
+#define AVX __builtin_cpu_supports("avx")
+#else
+#define AVX 0
+#define copy256avx(...)
+#define fill256avx(...)
+#endif
+
+void mem_copy(volatile void *dst, const volatile void *src, uint64_t count, int width)
+{
+    switch(width)
+    {
+        case  8: for (uint64_t n = 0; n < count; n++) ((volatile uint8_t *)  dst)[n] = ((volatile uint8_t *)  src)[n]; break;
+        case 16: for (uint64_t n = 0; n < count; n++) ((volatile uint16_t *) dst)[n] = ((volatile uint16_t *) src)[n]; break;
+        case 32: for (uint64_t n = 0; n < count; n++) ((volatile uint32_t *) dst)[n] = ((volatile uint32_t *) src)[n]; break;
+        case 64: for (uint64_t n = 0; n < count; n++) ((volatile uint64_t *) dst)[n] = ((volatile uint64_t *) src)[n]; break;
+        case 128: copy128(dst, src, count); break;
+        case 256:
+            if (AVX) copy256avx(dst, src, count);
+            else copy128(dst, src, count * 2);
+            break;
+    }
+}
+
+void mem_fill(volatile void *dst, uint64_t data, uint64_t count, int width)
+{
+    switch(width)
+    {
+        case  8: for (uint64_t n = 0; n < count; n++) ((volatile uint8_t *)  dst)[n] = data; break;
+        case 16: for (uint64_t n = 0; n < count; n++) ((volatile uint16_t *) dst)[n] = data; break;
+        case 32: for (uint64_t n = 0; n < count; n++) ((volatile uint32_t *) dst)[n] = data; break;
+        case 64: for (uint64_t n = 0; n < count; n++) ((volatile uint64_t *) dst)[n] = data; break;
+        case 128: fill128(dst, (v128){data}, count); break;
+        case 256:
+            if (AVX) fill256avx(dst, &(v256){data}, count);
+            else while (count--)
+            {
+                fill128(dst, (v128){data}, 1);
+                fill128(dst + 16, (v128){0}, 1);
+                dst += 32;
+            }
+            break;
+    }
+}
+
+void mem_fence(int store)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (store) asm volatile ("sfence" ::: "memory");
+    else asm volatile ("mfence" ::: "memory");
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+    if (store) asm volatile ("dsb st" ::: "memory");
+    else asm volatile ("dsb sy" ::: "memory");
+#else
+    // __sync_synchronize() may not order device memory, but it's the best there is
+    (void)store;
+    __sync_synchronize();
+#endif
+}
+
+static uint64_t swapped(uint64_t data, int width, int flags)
+{
+    if (flags & MEM_SWAP) switch(width)
+    {
+        case 16: return bswap_16(data);
+        case 32: return bswap_32(data);
+        case 64: return bswap_64(data);
+    }
+    return data;
+}
+
+// Return true if a pread() or pwrite() transferred the width, else set errno
+static int io(ssize_t r, int width)
+{
+    if (r == width/8) return 1;
+    if (r >= 0) errno = EIO;
+    return 0;
+}
+
+// mem_rmw() without the barrier
+static int rmw(struct mem *m, uint64_t address, int width, int opcode, uint64_t data, int flags, uint64_t *result)
+{
+    if ((width != 8 && width != 16 && width != 32 && width != 64) || opcode < MEM_READ || opcode > MEM_XOR)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // /dev/port is read and written at the file offset instead
+    uint64_t port;
+    void *p = m->port ? &port : mem_map(m, address, width/8, flags);
+    if (!p) return -1;
+    if (m->port && opcode != MEM_WRITE && !io(pread(m->fd[0], &port, width/8, address), width)) return -1;
+
+    data = swapped(data, width, flags);
+    uint64_t value = (opcode == MEM_WRITE) ? data : mem_peek(p, width);
+    switch(opcode)
+    {
+        case MEM_WRITE: value = data; break;
+        case MEM_AND: value &= data; break;
+        case MEM_OR: value |= data; break;
+        case MEM_XOR: value ^= data; break;
+    }
+    if (opcode != MEM_READ)
+    {
+        mem_poke(p, width, value);
+        if (m->port && !io(pwrite(m->fd[0], &port, width/8, address), width)) return -1;
+    }
+    if (result) *result = swapped(value & (UINT64_MAX >> (64 - width)), width, flags);
+    return 0;
+}
+
+int mem_rmw(struct mem *m, uint64_t address, int width, int opcode, uint64_t data, int flags, uint64_t *result)
+{
+    if (rmw(m, address, width, opcode, data, flags, result)) return -1;
+    if (opcode != MEM_READ) mem_fence(0);
+    return 0;
+}
+
+size_t mem_submit(struct mem *m, struct mem_op *ops, size_t count)
+{
+    size_t n;
+    for (n = 0; n < count; n++)
+        if (rmw(m, ops[n].address, ops[n].width, ops[n].opcode, ops[n].data, ops[n].flags, &ops[n].result)) break;
+    int e = errno;
+    mem_fence(0);
+    errno = e;
+    return n;
+}
+
+#define ACCESSORS(bits) \
+int mem_read##bits(struct mem *m, uint64_t address, uint##bits##_t *value) \
+{ \
+    uint64_t v; \
+    if (rmw(m, address, bits, MEM_READ, 0, 0, &v)) return -1; \
+    *value = v; \
+    return 0; \
+} \
+int mem_write##bits(struct mem *m, uint64_t address, uint##bits##_t value) \
+{ \
+    return mem_rmw(m, address, bits, MEM_WRITE, value, 0, NULL); \
+}
+ACCESSORS(8)
+ACCESSORS(16)
+ACCESSORS(32)
+ACCESSORS(64)
@@ -0,0 +1,171 @@
+// This software is released as-is into the public domain, as described at
+// https://unlicense.org. Do whatever you like with it.
+
+// See https://github.com/glitchub/mem for more information.
+
+// libmem, physical memory access through /dev/mem. This is the engine behind the mem command, for
+// tools that want register access without spawning a process per operation.
+//
+// It's the access layer only: devices, mappings, value accesses and batches of them, and snapshots.
+// The operation syntax, output formatting and the operations built from these (ranges, polls, find,
+// digests, verify, replay, groups) stay in mem. Tools that want those use "mem -f -" as a coprocess
+// or "mem -L" instead, without a process per operation either.
+//
+// Functions that can fail return 0 (or a pointer) on success, or -1 (or NULL) with errno set. A
+// handle caches its mappings and must not be used by more than one thread at a time, use a handle per
+// thread instead, see mem_clone().
+
+#ifndef LIBMEM_H
+#define LIBMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mem;
+
+// Operators for mem_rmw() and struct mem_op
+enum { MEM_READ, MEM_WRITE, MEM_AND, MEM_OR, MEM_XOR };
+
+// Flags for mem_map(), mem_rmw() and struct mem_op
+#define MEM_SWAP   1 // values are byte-swapped relative to memory
+#define MEM_CACHED 2 // map cached, for bulk access to RAM
+
+// Open the device, NULL for /dev/mem. Addresses are physical for /dev/mem, otherwise they're offsets
+// into the device, which can be:
+//
+//   - a PCI BAR's /sys/bus/pci/devices/*/resourceN file, MEM_CACHED maps its resourceN_wc if it has one
+//   - "/dev/uioN" for UIO map 0, or "/dev/uioN:M" for map M
+//   - /dev/port, which can't be mapped and only supports mem_rmw(), mem_submit() and the accessors
+//   - a snapshot file (see below), whose addresses are those of the regions it contains. Writes only
+//     change a private copy.
+//   - any other regular file, or character device that supports mmap
+//   - "memfd:size", size bytes of anonymous memory that's initially zero, for testing without hardware
+//
+// Accesses to resource files, UIO maps and regular files are checked against their size.
+struct mem *mem_open(const char *device);
+
+// Return 0 if the device can't be mapped, i.e. it's /dev/port
+int mem_mappable(struct mem *m);
+
+// Return the size of the device in bytes, 0 if it's unknown (e.g. /dev/mem)
+uint64_t mem_size(struct mem *m);
+
+// Return a new handle for the same device as m, with its own mapping cache, e.g. for another thread.
+// It shares a memfd or snapshot with m, so m must stay open until the clone is closed.
+struct mem *mem_clone(struct mem *m);
+
+// Unmap everything and close
+void mem_close(struct mem *m);
+
+// Return a pointer to size bytes at the physical address, mapping them if they aren't already. Only
+// MEM_CACHED is meaningful in flags. The pointer is valid until the next mem_map() (including those
+// made by the functions below) or mem_close(), and must be accessed with the mem_peek(), mem_poke(),
+// mem_copy() and mem_fill() functions or through volatile pointers of the appropriate width. Requests
+// of 64 KiB or more are pre-faulted, and windows of 2 MiB or more are placed so the kernel can use
+// huge pages for them.
+void *mem_map(struct mem *m, uint64_t address, uint64_t size, int flags);
+
+// Counters kept by a handle: mem_map()s satisfied from its mapping cache, and the windows it mapped and
+// unmapped, with the nanoseconds spent doing so
+struct mem_stats
+{
+    uint64_t hits;
+    uint64_t maps, mapns;
+    uint64_t unmaps, unmapns;
+};
+
+void mem_stats(struct mem *m, struct mem_stats *stats);
+
+// Read or write a native value. Writes are followed by a barrier.
+int mem_read8(struct mem *m, uint64_t address, uint8_t *value);
+int mem_read16(struct mem *m, uint64_t address, uint16_t *value);
+int mem_read32(struct mem *m, uint64_t address, uint32_t *value);
+int mem_read64(struct mem *m, uint64_t address, uint64_t *value);
+int mem_write8(struct mem *m, uint64_t address, uint8_t value);
+int mem_write16(struct mem *m, uint64_t address, uint16_t value);
+int mem_write32(struct mem *m, uint64_t address, uint32_t value);
+int mem_write64(struct mem *m, uint64_t address, uint64_t value);
+
+// Apply the opcode with data to the value of given width (8, 16, 32 or 64) at the address, with a
+// single read and/or write. If result isn't NULL it gets the value read by MEM_READ, or the value
+// written otherwise. Writes are followed by a barrier.
+int mem_rmw(struct mem *m, uint64_t address, int width, int opcode, uint64_t data, int flags, uint64_t *result);
+
+// An operation for mem_submit()
+struct mem_op
+{
+    uint8_t opcode;     // MEM_READ, etc
+    uint8_t width;      // 8, 16, 32 or 64
+    uint8_t flags;      // MEM_SWAP, MEM_CACHED
+    uint64_t address;
+    uint64_t data;      // operand
+    uint64_t result;    // as for mem_rmw()
+};
+
+// Perform count operations in order, with a single barrier at the end. Return the number performed,
+// if it's less than count then the next one failed and errno is set.
+size_t mem_submit(struct mem *m, struct mem_op *ops, size_t count);
+
+// Read or write one native value of width 8, 16, 32 or 64 through a mapped pointer
+uint64_t mem_peek(const volatile void *address, int width);
+void mem_poke(volatile void *address, int width, uint64_t data);
+
+// Copy count native values of width 8 to 256, between mapped pointers and/or normal memory, with one
+// access of the width per value. 128- and 256-bit accesses use SSE, AVX or NEON where the CPU supports
+// them, otherwise the widest access it does.
+void mem_copy(volatile void *dst, const volatile void *src, uint64_t count, int width);
+
+// Fill count values of width 8 to 256 with zero-extended data, one access of the width per value
+void mem_fill(volatile void *dst, uint64_t data, uint64_t count, int width);
+
+// Barrier that orders device memory as well as normal memory. If store is set, only orders stores.
+void mem_fence(int store);
+
+// A snapshot file is a capture of regions of memory and a log of the operations performed, in native
+// byte order: a MEM_SNAPSHOT_HEADER byte header starting with MEM_SNAPSHOT_MAGIC, the data of each
+// region padded to a multiple of MEM_SNAPSHOT_HEADER bytes, the table of regions in the order they
+// were captured or performed, and a trailer that locates the table and also ends with the magic.
+//
+// mem_open() of a snapshot only sees the MEM_READ regions. They may overlap, an access uses the region
+// with the highest base that contains it, the last captured if there are several.
+#define MEM_SNAPSHOT_MAGIC "MEMSNAP1"
+#define MEM_SNAPSHOT_HEADER 64
+
+struct mem_region
+{
+    uint64_t address;   // physical address (or device offset) of the first byte
+    uint64_t length;    // bytes of data, see below
+    uint64_t offset;    // file offset of the data
+    uint16_t width;     // access width of the capture, 8 to 256
+    uint8_t flags;      // MEM_SWAP and MEM_CACHED, as captured. For MEM_FENCE, 1 if store only.
+    uint8_t opcode;     // see below
+    uint32_t count;     // for the operand opcodes, the number of values operated on, otherwise 0
+};
+
+// Region opcodes: MEM_READ is captured memory contents and MEM_WRITE is the bytes written, a multiple
+// of width/8. The operand opcodes operate on count values from the address: MEM_AND, MEM_OR and MEM_XOR
+// applied the 8 byte operand in the data, MEM_FIELD replaced the bits set in the second of its 16 bytes
+// of operands with the first, both for widths up to 64. MEM_FENCE is a barrier with no data. Operands
+// are in memory order.
+enum { MEM_FIELD = MEM_XOR + 1, MEM_FENCE };
+
+struct mem_trailer
+{
+    uint64_t table;     // file offset of the region table
+    uint64_t regions;   // number of regions
+    char magic[8];      // MEM_SNAPSHOT_MAGIC
+};
+
+// Given a snapshot file mapped in memory, return its region table and set *regions, or return NULL
+// if it isn't a valid snapshot
+const struct mem_region *mem_table(const void *snapshot, uint64_t size, uint64_t *regions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,16 +3,35 @@
 
 // See https://github.com/glitchub/mem for more information.
 
+#define _GNU_SOURCE
 #include <byteswap.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <getopt.h>
 #include <unistd.h>
 
+#include "libmem.h"
+
 // die with a message
 #define die(...) fprintf(stderr, __VA_ARGS__), exit(1)
 
@@ -20,20 +39,84 @@ static void usage(void)
 {
     die(R"(Usage:
 
-    mem [mode] operation [... [mode] operation]
+    mem [options] [mode] operation [... [mode] operation]
 
 Perform read and write operations on physical memory.
 
+Options are:
+
+   -c count - with -r, stop after this many samples, default is until interrupted
+   -D dev   - access the device instead of /dev/mem, see below
+   -d       - with -r, only output values that changed since the previous sample
+   -f file  - after the command line operations, perform operations read from the file, "-" is stdin
+   -j jobs  - read ranges larger than 4 MiB with this many threads, if stdout is a file or with -z
+   -L addr  - after any operations, serve requests on the socket address, see below
+   -l       - flush output after each line of the file
+   -m count - with verify:, output up to this many mismatches, default 1, 0 for just the status
+   -n       - with -j, run each thread on the NUMA node that owns the memory it's reading
+   -r hz    - sample the command line operations at this rate instead of performing them once
+   -S file  - save reads to the snapshot file instead of outputting them, see below
+   -s spins - poll this many times before backing off with increasing sleeps, default 1000
+   -t ms    - fail if a poll takes longer than this many milliseconds, default 1000
+   -z       - compress the output as an LZ4 frame, e.g. "mem -z 0x80000000:0x4000000 | lz4 -d"
+   --stats  - at exit, print to stderr the count and total nanoseconds of argument parsing, opening
+              the device, mem_map() calls, the mmap() and munmap() calls they made, output writes,
+              and each type of operation performed
+
+The file contains modes and operations in the same form as the command line, separated by whitespace,
+any number per line. A '#' at the start of a token starts a comment to the end of the line. The mode
+carries over from the command line and from line to line. Unlike the command line, each line is
+performed as soon as it is read, so that "mem -l -f -" can be driven interactively as a coprocess.
+
 "operation" is in one of the following forms:
 
-   address        - output the value at the address
-   address=value  - write the value to the address
-   address&=value - binary AND the value to the address
-   address^=value - binary XOR the value to the address
-   address|=value - binary OR the value to the address
+   address             - output the value at the address
+   address=value       - write the value to the address
+   address&=value      - binary AND the value to the address
+   address^=value      - binary XOR the value to the address
+   address|=value      - binary OR the value to the address
+   address[hi:lo]=value - write the value to bits hi down to lo of the address, with one read and
+                         one write. "[bit]" is a single bit. The value must fit in the field.
+   address=@file       - write the contents of the file to consecutive addresses, "-" is stdin
+   address?mask==value - wait until the value at the address ANDed with mask equals value
+   address?mask!=value - wait until the value at the address ANDed with mask does not equal value
+   bench:address       - time reads of the address, print latency and bandwidth
+   bench:address=value - time writes of the value to the address, print latency and bandwidth
+   find:address=value  - output the address of each value in the range that equals value
+   find:address=value/mask - as above, comparing only the bits set in mask
+   find:address=#hex   - output the address of each occurrence of the hex byte string, at any
+                         alignment, e.g. "#5F534D5F" for "_SM_". "/#hex" gives a mask as above.
+   crc:address         - output the CRC32C of the bytes in the range
+   xxh:address         - output the XXH64 of the bytes in the range
+   replay:file         - perform the captures and operations saved in a snapshot file, see -S
+   verify:address=@file - compare consecutive addresses with the contents of the file, output
+                         "address memory file" for each mismatch (up to -m) and exit with status 1
+   !                   - barrier, previous accesses complete before any following access
+   !w                  - store barrier, previous writes complete before any following write
+   [ ... ]             - batch, the enclosed operations are performed with a single barrier at "]"
+   { ... }             - group, the enclosed operations are performed in order on their own thread
 
 Addresses and values can be up to 64-bit, given in decimal, hex, or octal.
 
+Every write, AND, XOR, OR and field update is followed by a barrier, so the device sees the operations
+in order. Operations in a batch are not, so a sequence of writes can be issued back-to-back and
+completed with one barrier. Batches can span lines of a file, but must be closed.
+
+Consecutive groups run concurrently, each with its own mappings, e.g. to program independent
+controllers in parallel. The first operation after them waits for them all to finish, and their
+output is then written in the order of the groups, so each group's output is held in memory until
+then. Groups can contain batches but not other groups, can span lines of a file, and must be closed.
+With -l, the groups started on a line finish at its end. If an operation in a group fails, mem exits
+without that group's output. Groups can't be used with -S, and ranges in them don't use -j.
+
+Except for "=@file" and polls, the address can also be a range, either "address:count" for count consecutive
+values or "start..end" for the values from start up to but not including end. Reading a range outputs
+every value in it, the other operations apply the value to every value in it (e.g. "0x1000:64=0" zeros
+64 values). Counts are in units of the current width, file lengths must be a multiple of it. Ranges and
+files are mapped once and processed in a single pass. Those of 64 KiB or more are pre-faulted, and
+those of 2 MiB or more are mapped at huge page alignment, so the kernel can use huge pages if the
+device supports them.
+
 "mode" can be one of the following, and sets the bit width and relative endian-ness of all subsequent
 operations (until the next mode character):
 
@@ -44,194 +127,2326 @@ operations (until the next mode character):
    H - swapped 16-bit
    W - swapped 32-bit
    D - swapped 64-bit
+   q - native 128-bit
+   o - native 256-bit
+
+Or one of the following, which sets the output format of all subsequent operations:
 
-Input values that exceed the current width are silently truncated.
+   x - hex text (this is the default)
+   r - raw binary
 
-Output values are printed to stdout in hex, zero-justified to the current width, one per line.
+Or one of the following, which sets the memory access of all subsequent operations:
+
+   u - uncached and strongly ordered, for device registers (this is the default)
+   c - cached, for bulk access to RAM. The kernel still maps anything that isn't RAM uncached, but
+       cached accesses may be merged, reordered, or deferred, so don't use it for registers.
+
+Input values that exceed the current width are silently truncated. 128- and 256-bit widths only support
+reads, writes and bench, and input values are zero-extended. They use single SSE/AVX or NEON loads and
+stores where the CPU supports them, otherwise the widest access that it does.
+
+Hex output values are printed to stdout zero-justified to the current width, one per line. Raw output
+values are written to stdout as native-endian binary of the current width, or byte-swapped in the
+swapped modes, with no separators.
 
 Exit status is zero on success or non-zero on any error.
 
+With -r, the operations must all be reads. Each sample is output as a line containing the timestamp
+in monotonic nanoseconds and the hex values, all separated by commas. If the reads are raw, each
+sample is the 64-bit native timestamp followed by the raw values. Samples go through a 16 MiB
+buffer that is written by a separate thread, so that output doesn't disturb the sample timing.
+Rates above 10 kHz busy-wait rather than sleep.
+
+With -d, a sample outputs a line for each value that changed, containing the timestamp, the address,
+the old value and the new value. The first sample outputs every value, with the old value the same as
+the new. If the reads are raw the line is the 64-bit native timestamp and address followed by the raw
+old and new values.
+
+With -z, all output is a single LZ4 frame of independently compressed blocks of up to 1 MiB, which
+"lz4 -d" or any LZ4 frame decoder restores. With -j, each thread compresses its own chunks, and they
+are written in order.
+
+With -S, each read (usually of a range) is saved to the snapshot file as a region holding the memory
+contents, and the address, width and mode they were read with. Writes, loads, ANDs, ORs, XORs, field
+updates and barriers ("!", "!w", "]", and the one after each of those operations outside a batch)
+are performed and recorded too. -D recognizes a snapshot and reads its captured regions back without
+hardware, O(log regions) to look up. An address that wasn't captured fails, and writes only change
+mem's private copy. See libmem.h for the format.
+
+"replay:file" performs a snapshot in order, writing the captured regions back at their width and
+repeating the recorded operations. Between recorded barriers, regions are grouped by 2 MiB mapping
+window unless that would reorder regions that overlap, and there's a single barrier at each recorded
+barrier and at the end. Operations within a window keep their order, so only captures and the
+operations of a batch are regrouped.
+
+With -D, addresses are offsets into the device instead of physical addresses. The device can be a
+PCI BAR's /sys/bus/pci/devices/*/resourceN file (cached access uses its resourceN_wc file, if the BAR
+is prefetchable), "/dev/uioN" for UIO map 0 or "/dev/uioN:M" for map M, a regular file, any
+character device that supports mmap, or "memfd:size" for size bytes of zeroed anonymous memory that
+lasts as long as mem does (e.g. to test scripts without hardware). Accesses beyond the end of a BAR,
+map, file or memfd fail and devices up to 256 MiB are mapped whole on first access. /dev/port can't
+be mapped, and only supports reads, writes, AND, OR, XOR and field updates, performed one value at a
+time with pread() and pwrite().
+
+With -L, mem listens on a Unix socket (if the name contains '/') or TCP [host]:port, and keeps
+/dev/mem and its mappings open while serving clients. Clients aren't authenticated, so without a host
+TCP only listens on 127.0.0.1, give e.g. "0.0.0.0:port" to listen on every interface. Each request message is a little-endian 32-bit
+record count and 32 reserved bits, followed by that many 24-byte records:
+
+   byte 0      - operation, 0 = read, 1 = write, 2 = AND, 3 = OR, 4 = XOR
+   byte 1      - width, 8, 16, 32 or 64
+   byte 2      - flags, 1 = swapped, 2 = cached
+   bytes 3-7   - reserved
+   bytes 8-15  - address
+   bytes 16-23 - value
+
+The records are performed in order and followed by a single barrier. The reply is a 32-bit status,
+which is 0 on success or the 1-based index of an invalid or unmappable record (which, and the records
+after it, are not performed), the 32-bit record count, and a 64-bit result per record: the value read,
+or the value written. A connection is dropped on any I/O error, a count larger than 65536, or if a
+message or reply stalls for more than a second part way through.
+
 E.G. set the LSB of a 32-bit register, write a value to another, print a byte from a third, clear
 the first register's LSB again:
 
     $ sudo mem "0x12345678|=1" 0x1234567C=44 b 0x12345674 w 0x12345678^=1
     0xA7
 
-Remember to quote | and & shell meta-characters!
+Remember to quote the |, &, ? and ! shell meta-characters!
 
 )"
     );
 }
 
-#define MAXOPS 256
-enum { READ, WRITE, AND, OR, XOR };
+enum { READ = MEM_READ, WRITE = MEM_WRITE, AND = MEM_AND, OR = MEM_OR, XOR = MEM_XOR, POLL, BENCH, FENCE, FIND, CRC, XXH, VERIFY, FIELD, REPLAY, GROUP };
 
-int main(int argc, char* argv[])
+// An operation
+struct op
+{
+    int operator; // one of the enums above
+    int width;
+    int swap;
+    int raw; // output raw binary instead of hex
+    int cached; // map without O_SYNC
+    uint64_t address;
+    uint64_t count; // number of consecutive values
+    uint64_t data;
+    char *file; // for WRITE, VERIFY and REPLAY, the source file name or NULL
+    uint64_t mask; // for POLL, FIND and FIELD
+    char *pattern; // for FIND, hex bytes and optional "/#" hex mask
+    int ne; // for POLL, wait for not equal
+    int store; // for BENCH, time writes of data instead of reads. For FENCE, order stores only.
+    int batch; // don't fence after WRITE, AND, OR, XOR or FIELD
+    int group; // inside "{ ... }", GROUP is the "}"
+};
+
+// The device handle, each group thread has its own, and the device set by -D or NULL for /dev/mem
+static __thread struct mem *M;
+static char *device;
+
+// Set by -z
+static int compress;
+
+// Return monotonic nanoseconds
+static uint64_t nsec(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Set by --stats, the count and nanoseconds of each phase and operator, reported at exit
+static int stats;
+enum { PARSING, OPENING, MAPPING, WRITING, PHASES };
+static struct tally { uint64_t count, ns; } PHASE[PHASES], OPERATION[REPLAY + 1];
+
+// Perform the statements, with --stats add them to the tally. Output is also written by the writer
+// thread, hence atomic.
+#define TIMED(tally, ...) do \
+{ \
+    uint64_t t_ = stats ? nsec() : 0; \
+    __VA_ARGS__; \
+    if (stats) \
+    { \
+        __atomic_add_fetch(&(tally).count, 1, __ATOMIC_RELAXED); \
+        __atomic_add_fetch(&(tally).ns, nsec() - t_, __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+// The mem_stats() of closed clones: group and -j worker handles
+static struct mem_stats clonestats;
+
+// Add a clone's mem_stats() to clonestats and close it
+static void release(struct mem *m)
+{
+    struct mem_stats s;
+    mem_stats(m, &s);
+    __atomic_add_fetch(&clonestats.maps, s.maps, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&clonestats.mapns, s.mapns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&clonestats.unmaps, s.unmaps, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&clonestats.unmapns, s.unmapns, __ATOMIC_RELAXED);
+    mem_close(m);
+}
+
+// Return the XXH32 of fewer than 16 bytes, as needed for the LZ4 frame descriptor checksum
+static uint32_t xxh32(const uint8_t *p, size_t len)
 {
-    // parse
-    struct
+    #define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+    uint32_t h = 0x165667B1 + len; // the seed is 0
+    for (; len >= 4; p += 4, len -= 4)
     {
-        int operator; // one of the enums above
-        int width;
-        int swap;
-        uint64_t address;
-        uint64_t data;
-    } OP[MAXOPS] = {0};
+        uint32_t lane;
+        memcpy(&lane, p, 4);
+        h = ROTL32(h + lane * 0xC2B2AE3D, 17) * 0x27D4EB2F;
+    }
+    for (; len; p++, len--) h = ROTL32(h + *p * 0x165667B1U, 11) * 0x9E3779B1;
+    h ^= h >> 15;
+    h *= 0x85EBCA77;
+    h ^= h >> 13;
+    h *= 0xC2B2AE3D;
+    return h ^ (h >> 16);
+    #undef ROTL32
+}
 
-    int width = 32, swap = 0, ops = 0;
+// LZ4 compress len bytes of src into dst, greedily with a hash table of 4-byte sequences, skipping
+// faster through data that doesn't match. Return the compressed length, or 0 if it isn't smaller
+// than len.
+#define LZ4HASH 12
+static size_t lz4(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    uint32_t table[1 << LZ4HASH] = {0};
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst, *limit = dst + len;
 
-    for (int x = 1; x < argc; x++)
+    // the last match starts at least 12 bytes from the end, the last 5 bytes are literals
+    if (len >= 13) for (unsigned misses = 1 << 6; ip < end - 12;)
     {
-        char *arg = argv[x], *p;
-        switch (*arg)
+        uint32_t seq, ref;
+        memcpy(&seq, ip, 4);
+        uint32_t *slot = &table[(seq * 2654435761U) >> (32 - LZ4HASH)];
+        const uint8_t *match = src + *slot;
+        *slot = ip - src;
+        memcpy(&ref, match, 4);
+        if (match >= ip || ip - match > 65535 || ref != seq)
         {
-            case 'b': width =  8; swap = 0; continue;
-            case 'h': width = 16; swap = 0; continue;
-            case 'w': width = 32; swap = 0; continue;
-            case 'd': width = 64; swap = 0; continue;
-            case 'H': width = 16; swap = 1; continue;
-            case 'W': width = 32; swap = 1; continue;
-            case 'D': width = 64; swap = 1; continue;
+            ip += misses++ >> 6;
+            continue;
         }
+        misses = 1 << 6;
 
-        if (ops == MAXOPS) die ("Too many operations\n");
+        while (ip > anchor && match > src && ip[-1] == match[-1]) ip--, match--;
+        size_t n = 4;
+        while (ip + n < end - 5 && ip[n] == match[n]) n++;
 
-        OP[ops].width = width;
-        OP[ops].swap = swap;
-        OP[ops].address = strtoull(arg, &p, 0);
-        if (p == arg) goto choke;
-        switch (*p++)
+        size_t literals = ip - anchor;
+        if (op + literals + literals / 255 + n / 255 + 5 > limit) return 0;
+        uint8_t *token = op++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15)
+        {
+            size_t l = literals - 15;
+            for (; l >= 255; l -= 255) *op++ = 255;
+            *op++ = l;
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        *op++ = (ip - match);
+        *op++ = (ip - match) >> 8;
+        *token |= (n - 4 < 15) ? n - 4 : 15;
+        if (n - 4 >= 15)
         {
-            case 0:
-                OP[ops].operator = READ;
-                goto next;
+            size_t l = n - 4 - 15;
+            for (; l >= 255; l -= 255) *op++ = 255;
+            *op++ = l;
+        }
+        ip += n;
+        anchor = ip;
+    }
 
-            case '&':
-                if (*p++ != '=') goto choke;
-                OP[ops].operator = AND;
-                break;
+    size_t literals = end - anchor;
+    if (op + literals + literals / 255 + 2 > limit) return 0;
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+    {
+        size_t l = literals - 15;
+        for (; l >= 255; l -= 255) *op++ = 255;
+        *op++ = l;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (op < limit) ? op - dst : 0;
+}
 
-            case '^':
-                if (*p++ != '=') goto choke;
-                OP[ops].operator = XOR;
-                break;
+// With -z, output is an LZ4 frame of independent blocks of up to 1 MiB, no checksums
+#define BLOCK (1 << 20)
 
-            case '|':
-                if (*p++ != '=') goto choke;
-                OP[ops].operator = OR;
-                break;
+// Make an LZ4 block of up to BLOCK bytes in dst, which has room for BLOCK + 4. Return its length.
+static size_t block(uint8_t *dst, const void *src, size_t len)
+{
+    uint32_t size = lz4(dst + 4, src, len);
+    if (!size)
+    {
+        // stored
+        memcpy(dst + 4, src, len);
+        size = len | 0x80000000;
+    }
+    for (int n = 0; n < 4; n++) dst[n] = size >> (n * 8);
+    return 4 + (size & 0x7FFFFFFF);
+}
 
-            case '=':
-                OP[ops].operator = WRITE;
-                break;
+// Output is collected in OUT and written to stdout in large chunks. When OUT fills, spill() hands it
+// to a writer thread and output continues in the other buffer, so reading memory overlaps writing
+// the previous chunk. flush() writes everything before returning. Group threads collect their output
+// in their own OUT instead, see spill().
+#define OUTBUF (1 << 20)
+static char BUFFERS[2][OUTBUF];
+static __thread char *OUT = BUFFERS[0];
+static __thread size_t outlen;
+
+// Groups, "{ ... }". Operations in a group are collected as they're parsed, and performed on their
+// own thread with a clone of the handle when the group closes. See execute().
+static struct group
+{
+    struct op *ops;
+    size_t count;
+    char *out; // output, collected by spill()
+    size_t len;
+    struct mem *m;
+    pthread_t thread;
+} **groups, *collecting; // running, and being collected
+static size_t ngroups;
+static __thread struct group *grouped; // being performed by this thread
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf; // being written by the thread, or NULL
+    size_t len;
+    int started;
+} PIPE = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-            default:
-            choke: die("'%s' is invalid\n", arg);
+static void put(char *buf, size_t len)
+{
+    for (size_t n = 0; n < len;)
+    {
+        ssize_t w;
+        TIMED(PHASE[WRITING], w = write(1, buf + n, len - n));
+        if (w < 0)
+        {
+            if (errno == EINTR) continue;
+            // may be called from atexit(), so don't exit() again
+            fprintf(stderr, "Can't write output: %s\n", strerror(errno));
+            _exit(1);
         }
+        n += w;
+    }
+}
 
-        // get value
-        if (!*p) goto choke;
-        uint64_t data = strtoull(p, &p, 0);
-        if (*p) goto choke;
-        if (swap) switch(width)
+// Write the LZ4 frame header, once
+static void frame(void)
+{
+    static int framed;
+    if (framed) return;
+    framed = 1;
+    uint8_t header[7] = { 0x04, 0x22, 0x4D, 0x18, 0x60, 0x60 }; // independent 1 MiB blocks
+    header[6] = xxh32(header + 4, 2) >> 8;
+    put((char *)header, 7);
+}
+
+// Write output to stdout, compressed if -z. Only one thread at a time.
+static void emit(char *buf, size_t len)
+{
+    static uint8_t compressed[BLOCK + 4];
+    if (!compress)
+    {
+        put(buf, len);
+        return;
+    }
+    frame();
+    for (size_t n = 0, l; n < len; n += l)
+    {
+        l = (len - n < BLOCK) ? len - n : BLOCK;
+        put((char *)compressed, block(compressed, buf + n, l));
+    }
+}
+
+static void *pipeline(void *unused)
+{
+    pthread_mutex_lock(&PIPE.lock);
+    while (1)
+    {
+        while (!PIPE.buf) pthread_cond_wait(&PIPE.cond, &PIPE.lock);
+        pthread_mutex_unlock(&PIPE.lock);
+        emit(PIPE.buf, PIPE.len);
+        pthread_mutex_lock(&PIPE.lock);
+        PIPE.buf = NULL;
+        pthread_cond_broadcast(&PIPE.cond);
+    }
+    return unused;
+}
+
+// Wait for the writer thread to finish its buffer
+static void await(void)
+{
+    pthread_mutex_lock(&PIPE.lock);
+    while (PIPE.buf) pthread_cond_wait(&PIPE.cond, &PIPE.lock);
+    pthread_mutex_unlock(&PIPE.lock);
+}
+
+static void flush(void)
+{
+    if (PIPE.started) await();
+    emit(OUT, outlen);
+    outlen = 0;
+}
+
+// The snapshot file set by -S, see save()
+static char *capture;
+static int snapfd = -1;
+static uint64_t snapend; // file offset of the next region
+static struct mem_region *regions;
+static uint64_t nregions;
+
+static void store(const void *buf, size_t len)
+{
+    for (size_t n = 0; n < len;)
+    {
+        ssize_t w = write(snapfd, buf + n, len - n);
+        if (w < 0)
         {
-            case 16: data = bswap_16(data); break;
-            case 32: data = bswap_32(data); break;
-            case 64: data = bswap_64(data); break;
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Can't write %s: %s\n", capture, strerror(errno));
+            _exit(1);
         }
-        ops[OP].data = data;
-        next: ops++; // next
+        n += w;
+    }
+    snapend += len;
+}
+
+// Append a table entry for a region of length bytes, whose data the caller then stores, then pad()s
+static void region(int operator, struct op *op, uint64_t length)
+{
+    if (snapfd < 0)
+    {
+        snapfd = open(capture, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (snapfd < 0) die("Can't create %s: %s\n", capture, strerror(errno));
+        char header[MEM_SNAPSHOT_HEADER] = MEM_SNAPSHOT_MAGIC;
+        store(header, sizeof(header));
     }
+    if (!(nregions & (nregions + 1)) && !(regions = realloc(regions, (nregions + 1) * 2 * sizeof(struct mem_region))))
+        die("Out of memory\n");
+    regions[nregions++] = (struct mem_region){ .address = op->address, .length = length, .offset = snapend,
+        .width = op->width, .opcode = operator, .count = (operator >= MEM_AND && operator <= MEM_FIELD) ? op->count : 0,
+        .flags = (operator == MEM_FENCE) ? op->store : (op->swap ? MEM_SWAP : 0) | (op->cached ? MEM_CACHED : 0) };
+}
 
-    if (!ops) usage();
+static void pad(void)
+{
+    store((char[MEM_SNAPSHOT_HEADER]){0}, -snapend & (MEM_SNAPSHOT_HEADER - 1));
+}
 
-    // perform
-    int fd = open("/dev/mem", O_RDWR|O_SYNC);
-    if (fd < 0)  die("Can't open /dev/mem: %s\n", strerror(errno));
+// Write the region table and trailer, the snapshot is valid from here on
+static void endsnapshot(void)
+{
+    if (snapfd < 0) return;
+    struct mem_trailer t = { .table = snapend, .regions = nregions };
+    memcpy(t.magic, MEM_SNAPSHOT_MAGIC, 8);
+    store(regions, nregions * sizeof(struct mem_region));
+    store(&t, sizeof(t));
+    if (close(snapfd)) fprintf(stderr, "Can't write %s: %s\n", capture, strerror(errno)), _exit(1);
+    snapfd = -1;
+}
+
+// Print the --stats tallies to stderr
+static void report(void)
+{
+    static const char *OPERATORS[] =
+    {
+        [READ] = "read", [WRITE] = "write", [AND] = "and", [OR] = "or", [XOR] = "xor", [POLL] = "poll",
+        [BENCH] = "bench", [FENCE] = "barrier", [FIND] = "find", [CRC] = "crc", [XXH] = "xxh",
+        [VERIFY] = "verify", [FIELD] = "field", [REPLAY] = "replay"
+    };
+    struct mem_stats m = clonestats;
+    if (M)
+    {
+        struct mem_stats s;
+        mem_stats(M, &s);
+        m.maps += s.maps, m.mapns += s.mapns, m.unmaps += s.unmaps, m.unmapns += s.unmapns;
+    }
+
+    #define TALLY(name, count, ns) fprintf(stderr, "%-8s %12" PRIu64 " %16" PRIu64 "\n", name, count, ns)
+    fprintf(stderr, "%-8s %12s %16s\n", "phase", "count", "ns");
+    TALLY("parse", PHASE[PARSING].count, PHASE[PARSING].ns);
+    TALLY("open", PHASE[OPENING].count, PHASE[OPENING].ns);
+    TALLY("map", PHASE[MAPPING].count, PHASE[MAPPING].ns);
+    TALLY("mmap", m.maps, m.mapns);
+    TALLY("munmap", m.unmaps, m.unmapns);
+    TALLY("output", PHASE[WRITING].count, PHASE[WRITING].ns);
+    for (int o = 0; o <= REPLAY; o++)
+        if (OPERATION[o].count) TALLY(OPERATORS[o], OPERATION[o].count, OPERATION[o].ns);
+    #undef TALLY
+}
 
-    for (int op = 0; op < ops; op++)
+// Flush and end the LZ4 frame and snapshot, at exit
+static void finish(void)
+{
+    if (grouped) _exit(1); // a group failed, the main thread isn't writing its output meanwhile
+    endsnapshot();
+    flush();
+    if (compress)
+    {
+        frame();
+        put((char[4]){0}, 4);
+    }
+    if (stats) report();
+}
+
+static void spill(void)
+{
+    if (grouped)
     {
-        int pagesize = getpagesize();
-        int offset = OP[op].address % pagesize;
-        int size = ((offset + (OP[op].width/8)) > pagesize) ? 2*pagesize : pagesize;
-        void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)(OP[op].address - offset));
-        if (map == MAP_FAILED) die("Can't map address 0x%" PRIX64" :%s\n", OP[op].address, strerror(errno));
-        void *address = map + offset;
+        if (!(grouped->out = realloc(grouped->out, grouped->len + outlen))) die("Out of memory\n");
+        memcpy(grouped->out + grouped->len, OUT, outlen);
+        grouped->len += outlen;
+        outlen = 0;
+        return;
+    }
 
-        switch(OP[op].operator)
+    if (!PIPE.started)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pipeline, NULL))
         {
-            case READ:
-                switch(OP[op].width)
-                {
-                    case  8:
-                        printf("0x%.2" PRIX8 "\n", *(volatile uint8_t *) address);
-                        break;
-                    case 16:
-                    {
-                        uint16_t data = *(volatile uint16_t *) address;
-                        if (OP[op].swap) data = bswap_16(data);
-                        printf("0x%.4" PRIX16 "\n", data);
-                        break;
-                    }
-                    case 32:
-                    {
-                        uint32_t data = *(volatile uint32_t *) address;
-                        if (OP[op].swap) data = bswap_32(data);
-                        printf("0x%.8" PRIX32 "\n", data);
-                        break;
-                    }
-                    case 64:
-                    {
-                        uint64_t data = *(volatile uint64_t *) address;
-                        if (OP[op].swap) data = bswap_64(data);
-                        printf("0x%.16" PRIX64 "\n", data);
-                        break;
-                    }
-                }
-                break;
+            flush();
+            return;
+        }
+        pthread_detach(thread);
+        PIPE.started = 1;
+    }
+    await();
+    pthread_mutex_lock(&PIPE.lock);
+    PIPE.buf = OUT;
+    PIPE.len = outlen;
+    pthread_cond_broadcast(&PIPE.cond);
+    pthread_mutex_unlock(&PIPE.lock);
+    OUT = (OUT == BUFFERS[0]) ? BUFFERS[1] : BUFFERS[0];
+    outlen = 0;
+}
 
-            case WRITE:
-                switch(OP[op].width)
-                {
-                    case  8: *(uint8_t *)  address = OP[op].data; break;
-                    case 16: *(uint16_t *) address = OP[op].data; break;
-                    case 32: *(uint32_t *) address = OP[op].data; break;
-                    case 64: *(uint64_t *) address = OP[op].data; break;
-                }
-                break;
+// Format a value of given width into buf as hex text or raw binary, return the length
+static int format(char *buf, uint64_t data, int width, int raw)
+{
+    if (raw) switch(width)
+    {
+        case  8: *buf = data; return 1;
+        case 16: memcpy(buf, &(uint16_t){data}, 2); return 2;
+        case 32: memcpy(buf, &(uint32_t){data}, 4); return 4;
+        default: memcpy(buf, &(uint64_t){data}, 8); return 8;
+    }
+    char *p = buf;
+    *p++ = '0';
+    *p++ = 'x';
+    for (int shift = width - 4; shift >= 0; shift -= 4) *p++ = "0123456789ABCDEF"[(data >> shift) & 15];
+    *p++ = '\n';
+    return p - buf;
+}
 
-            case AND:
-                switch(OP[op].width)
-                {
-                    case  8: *(uint8_t *)  address &= OP[op].data; break;
-                    case 16: *(uint16_t *) address &= OP[op].data; break;
-                    case 32: *(uint32_t *) address &= OP[op].data; break;
-                    case 64: *(uint64_t *) address &= OP[op].data; break;
-                }
-                break;
+// Format a 128- or 256-bit value from its native-endian 64-bit lanes
+static int formatwide(char *buf, uint64_t *lanes, int width, int raw)
+{
+    if (raw)
+    {
+        memcpy(buf, lanes, width/8);
+        return width/8;
+    }
+    char *p = buf;
+    *p++ = '0';
+    *p++ = 'x';
+    for (int lane = width/64 - 1; lane >= 0; lane--)
+        for (int shift = 60; shift >= 0; shift -= 4)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            *p++ = "0123456789ABCDEF"[(lanes[lane] >> shift) & 15];
+#else
+            *p++ = "0123456789ABCDEF"[(lanes[width/64 - 1 - lane] >> shift) & 15];
+#endif
+    *p++ = '\n';
+    return p - buf;
+}
 
-            case OR:
-                switch(OP[op].width)
-                {
-                    case  8: *(uint8_t *)  address |= OP[op].data; break;
-                    case 16: *(uint16_t *) address |= OP[op].data; break;
-                    case 32: *(uint32_t *) address |= OP[op].data; break;
-                    case 64: *(uint64_t *) address |= OP[op].data; break;
-                }
-                break;
+// Bytes of formatted output per value
+#define OUTSIZE(width, raw) ((raw) ? (width)/8 : (width)/4 + 3)
 
-            case XOR:
-                switch(OP[op].width)
-                {
-                    case  8: *(uint8_t *)  address ^= OP[op].data; break;
-                    case 16: *(uint16_t *) address ^= OP[op].data; break;
-                    case 32: *(uint32_t *) address ^= OP[op].data; break;
-                    case 64: *(uint64_t *) address ^= OP[op].data; break;
-                }
-                break;
+// Output formatted text
+static void outputf(char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (outlen + len >= OUTBUF) spill();
+    if (len >= OUTBUF) die("Output too long\n");
+    va_start(ap, format);
+    vsnprintf(OUT + outlen, OUTBUF - outlen, format, ap);
+    va_end(ap);
+    outlen += len;
+}
+
+// Return a pointer to size bytes at the physical address, or die
+static void *map(uint64_t address, uint64_t size, int cached)
+{
+    void *p;
+    TIMED(PHASE[MAPPING], p = mem_map(M, address, size, cached ? MEM_CACHED : 0));
+    if (!p) die("Can't map address 0x%" PRIX64 ": %s\n", address, strerror(errno));
+    return p;
+}
+
+// Access kernels, one for each combination of operator, width and swap, so that a range is a loop
+// with no per-value decisions. The kernel for an operation is looked up once with kernels(). Reads
+// format count values from the address into out and return the length, writes, ANDs, ORs and XORs
+// apply data to count values and return 0. Polls read the address up to count times and return true
+// as soon as the value ANDed with mask equals data (or doesn't, if ne). Field updates replace the
+// bits in mask of count values with data.
+typedef size_t kernel(char *out, volatile void *address, uint64_t count, uint64_t data);
+typedef int poller(volatile void *address, uint64_t count, uint64_t mask, uint64_t data, int ne);
+typedef void updater(volatile void *address, uint64_t count, uint64_t mask, uint64_t data);
+
+#define NOSWAP(x) (x)
+
+#define KERNELS(name, type, swap) \
+static size_t name##hex(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    char *p = out; \
+    for (uint64_t n = 0; n < count; n++) p += format(p, swap(((volatile type *) address)[n]), sizeof(type) * 8, 0); \
+    return p - out; \
+} \
+static size_t name##raw(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) \
+    { \
+        type v = swap(((volatile type *) address)[n]); \
+        memcpy(out + n * sizeof(type), &v, sizeof(type)); \
+    } \
+    return count * sizeof(type); \
+} \
+static size_t name##write(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) ((volatile type *) address)[n] = data; \
+    return 0; \
+} \
+static size_t name##and(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) ((volatile type *) address)[n] &= data; \
+    return 0; \
+} \
+static size_t name##or(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) ((volatile type *) address)[n] |= data; \
+    return 0; \
+} \
+static size_t name##xor(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) ((volatile type *) address)[n] ^= data; \
+    return 0; \
+} \
+static int name##poll(volatile void *address, uint64_t count, uint64_t mask, uint64_t data, int ne) \
+{ \
+    while (count--) if (((*(volatile type *) address & mask) == data) != ne) return 1; \
+    return 0; \
+} \
+static void name##field(volatile void *address, uint64_t count, uint64_t mask, uint64_t data) \
+{ \
+    for (uint64_t n = 0; n < count; n++) \
+        ((volatile type *) address)[n] = (((volatile type *) address)[n] & ~mask) | data; \
+}
+
+KERNELS(b, uint8_t, NOSWAP)
+KERNELS(h, uint16_t, NOSWAP)
+KERNELS(w, uint32_t, NOSWAP)
+KERNELS(d, uint64_t, NOSWAP)
+KERNELS(H, uint16_t, bswap_16)
+KERNELS(W, uint32_t, bswap_32)
+KERNELS(D, uint64_t, bswap_64)
+
+// 128- and 256-bit only read and write
+#define WIDEKERNELS(name, bits) \
+static size_t name##hex(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    char *p = out; \
+    for (uint64_t n = 0; n < count; n++) \
+    { \
+        uint64_t lanes[bits/64]; \
+        mem_copy(lanes, address + n * (bits/8), 1, bits); \
+        p += formatwide(p, lanes, bits, 0); \
+    } \
+    return p - out; \
+} \
+static size_t name##raw(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    mem_copy(out, address, count, bits); \
+    return count * (bits/8); \
+} \
+static size_t name##write(char *out, volatile void *address, uint64_t count, uint64_t data) \
+{ \
+    mem_fill(address, data, count, bits); \
+    return 0; \
+}
+
+WIDEKERNELS(q, 128)
+WIDEKERNELS(o, 256)
+
+#define KERNEL(name) { name##hex, name##raw, name##write, name##and, name##or, name##xor, name##poll, name##field }
+#define WIDEKERNEL(name) { name##hex, name##raw, name##write }
+
+static const struct kernels { kernel *hex, *raw, *write, *and, *or, *xor; poller *poll; updater *field; } KERNELS[2][6] =
+{
+    { KERNEL(b), KERNEL(h), KERNEL(w), KERNEL(d), WIDEKERNEL(q), WIDEKERNEL(o) },
+    { KERNEL(b), KERNEL(H), KERNEL(W), KERNEL(D), WIDEKERNEL(q), WIDEKERNEL(o) },
+};
+
+// Return the kernels for the width and swap of the operation
+static const struct kernels *kernels(struct op *op)
+{
+    return &KERNELS[op->swap][__builtin_ctz(op->width / 8)];
+}
+
+// Return the kernel for the operator of the operation
+static kernel *kernelof(struct op *op)
+{
+    const struct kernels *k = kernels(op);
+    switch(op->operator)
+    {
+        case WRITE: return k->write;
+        case AND: return k->and;
+        case OR: return k->or;
+        case XOR: return k->xor;
+        default: return op->raw ? k->raw : k->hex;
+    }
+}
+
+// Read count values from the address and format them into buf, which must have room for
+// count * OUTSIZE(). Return the length.
+static size_t dump(char *buf, volatile void *address, uint64_t count, struct op *op)
+{
+    return (op->raw ? kernels(op)->raw : kernels(op)->hex)(buf, address, count, 0);
+}
+
+// Write the contents of a file ("-" is stdin) to consecutive addresses
+static void load(struct op *op)
+{
+    char *name = op->file;
+    int width = op->width, swap = op->swap;
+    int f = strcmp(name, "-") ? open(name, O_RDONLY) : 0;
+    if (f < 0) die("Can't open %s: %s\n", name, strerror(errno));
+
+    // slurp it, regular files in one read
+    struct stat st;
+    size_t size = (!fstat(f, &st) && S_ISREG(st.st_mode) && st.st_size) ? st.st_size + 1 : 1 << 16, len = 0;
+    char *buf = malloc(size);
+    while (1)
+    {
+        if (!buf) die("Out of memory\n");
+        ssize_t r = read(f, buf + len, size - len);
+        if (r < 0)
+        {
+            if (errno == EINTR) continue;
+            die("Can't read %s: %s\n", name, strerror(errno));
+        }
+        if (!r) break;
+        len += r;
+        if (len == size) buf = realloc(buf, size *= 2);
+    }
+    if (f) close(f);
+
+    if (!len) goto done;
+    if (len % (width/8)) die("%s length is not a multiple of %d bits\n", name, width);
+
+    // swap in place, so the memory sees one copy at the width
+    uint64_t count = len / (width/8);
+    if (swap) for (uint64_t n = 0; n < len; n += width/8) switch(width)
+    {
+        case 16: *(uint16_t *)(buf + n) = bswap_16(*(uint16_t *)(buf + n)); break;
+        case 32: *(uint32_t *)(buf + n) = bswap_32(*(uint32_t *)(buf + n)); break;
+        case 64: *(uint64_t *)(buf + n) = bswap_64(*(uint64_t *)(buf + n)); break;
+    }
+    if (capture)
+    {
+        region(MEM_WRITE, op, len);
+        store(buf, len);
+        pad();
+        if (!op->batch) region(MEM_FENCE, op, 0);
+    }
+    mem_copy(map(op->address, len, op->cached), buf, count, width);
+    done: free(buf);
+}
+
+// Current mode, set by the mode characters
+static int width = 32, swap = 0, raw = 0, cached = 0, batch = 0, grouping = 0;
+
+// Return data truncated to the current width, as it would be stored
+static uint64_t truncated(uint64_t data)
+{
+    return (width < 64) ? data & ((1ULL << width) - 1) : data;
+}
+
+// Return data byte-swapped per the current mode
+static uint64_t swapped(uint64_t data)
+{
+    if (swap) switch(width)
+    {
+        case 16: return bswap_16(data);
+        case 32: return bswap_32(data);
+        case 64: return bswap_64(data);
+    }
+    return data;
+}
+
+// Decode up to MAXPATTERN pairs of hex digits from s into buf (if not NULL), set *end to the first
+// non-hex character. Return the number of bytes, or -1 if invalid.
+#define MAXPATTERN 256
+static int unhex(char *s, char **end, uint8_t *buf)
+{
+    int len = 0;
+    for (; isxdigit(s[0]); s += 2, len++)
+    {
+        if (!isxdigit(s[1]) || len == MAXPATTERN) return -1;
+        if (buf) buf[len] = strtoul((char[]){ s[0], s[1], 0 }, NULL, 16);
+    }
+    *end = s;
+    return len;
+}
+
+// Parse an argument, return 1 if it's an operation or 0 if it's a mode character
+static int parsing(char *arg, struct op *op)
+{
+    // operations that don't have an operator character are "name:address"
+    static const struct { char *name; int operator; } NAMED[] =
+    {
+        { "bench:", BENCH },
+        { "find:", FIND },
+        { "crc:", CRC },
+        { "xxh:", XXH },
+        { "verify:", VERIFY },
+    };
+
+    *op = (struct op){ .group = grouping };
+    if (!strncmp(arg, "replay:", 7))
+    {
+        if (!arg[7]) goto choke;
+        op->operator = REPLAY;
+        op->file = arg + 7;
+        return 1;
+    }
+
+    char *p = arg;
+    for (int n = 0; n < sizeof(NAMED) / sizeof(NAMED[0]); n++)
+        if (!strncmp(arg, NAMED[n].name, strlen(NAMED[n].name)))
+        {
+            op->operator = NAMED[n].operator;
+            p += strlen(NAMED[n].name);
+            goto address;
+        }
+
+    switch (*arg)
+    {
+        case 'b': width =  8; swap = 0; return 0;
+        case 'h': width = 16; swap = 0; return 0;
+        case 'w': width = 32; swap = 0; return 0;
+        case 'd': width = 64; swap = 0; return 0;
+        case 'H': width = 16; swap = 1; return 0;
+        case 'W': width = 32; swap = 1; return 0;
+        case 'D': width = 64; swap = 1; return 0;
+        case 'q': width = 128; swap = 0; return 0;
+        case 'o': width = 256; swap = 0; return 0;
+        case 'x': raw = 0; return 0;
+        case 'r': raw = 1; return 0;
+        case 'u': cached = 0; return 0;
+        case 'c': cached = 1; return 0;
+        case '[':
+            if (arg[1] || batch) goto choke;
+            batch = 1;
+            return 0;
+        case ']':
+            if (arg[1] || !batch) goto choke;
+            batch = 0;
+            op->operator = FENCE;
+            return 1;
+        case '{':
+            if (arg[1] || grouping || batch) goto choke;
+            grouping = 1;
+            return 0;
+        case '}':
+            if (arg[1] || !grouping || batch) goto choke;
+            grouping = 0;
+            op->operator = GROUP;
+            return 1;
+        case '!':
+            if (arg[1] && strcmp(arg, "!w")) goto choke;
+            op->operator = FENCE;
+            op->store = arg[1] == 'w';
+            return 1;
+    }
+
+    address:
+    op->width = width;
+    op->swap = swap;
+    op->raw = raw;
+    op->cached = cached;
+    op->batch = batch;
+    char *s = p;
+    op->address = strtoull(s, &p, 0);
+    if (p == s) goto choke;
+    op->count = 1;
+    if (*p == ':')
+    {
+        char *s = p + 1;
+        op->count = strtoull(s, &p, 0);
+        if (p == s || !op->count || op->count > UINT64_MAX / (width/8)) goto choke;
+    }
+    else if (*p == '.')
+    {
+        if (*++p != '.') goto choke;
+        char *s = p + 1;
+        uint64_t end = strtoull(s, &p, 0);
+        if (p == s || end <= op->address || (end - op->address) % (width/8)) goto choke;
+        op->count = (end - op->address) / (width/8);
+    }
+
+    if (op->operator == BENCH)
+    {
+        if (!*p) return 1;
+        if (*p++ != '=') goto choke;
+        op->store = 1;
+        goto value;
+    }
+
+    if (op->operator == VERIFY)
+    {
+        if (*p++ != '=' || *p++ != '@' || !*p || op->count != 1) goto choke;
+        op->file = p;
+        return 1;
+    }
+
+    if (op->operator == CRC || op->operator == XXH)
+    {
+        if (*p) goto choke;
+        return 1;
+    }
+
+    if (op->operator == FIND)
+    {
+        if (*p++ != '=') goto choke;
+        op->mask = truncated(UINT64_MAX);
+        if (*p == '#')
+        {
+            op->pattern = ++p;
+            int len = unhex(p, &p, NULL);
+            if (len <= 0) goto choke;
+            if (!*p) return 1;
+            if (*p++ != '/' || *p++ != '#' || unhex(p, &p, NULL) != len || *p) goto choke;
+            return 1;
+        }
+        if (width > 64) goto choke;
+        s = p;
+        op->data = swapped(truncated(strtoull(s, &p, 0)));
+        if (p == s) goto choke;
+        if (!*p) return 1;
+        if (*p++ != '/') goto choke;
+        s = p;
+        op->mask = swapped(truncated(strtoull(s, &p, 0)));
+        if (p == s || *p) goto choke;
+        op->data &= op->mask;
+        return 1;
+    }
+
+    switch (*p++)
+    {
+        case 0:
+            op->operator = READ;
+            return 1;
+
+        case '[':
+        {
+            if (width > 64) goto choke;
+            char *s = p;
+            unsigned long hi = strtoul(s, &p, 0), lo = hi;
+            if (p == s) goto choke;
+            if (*p == ':')
+            {
+                s = p + 1;
+                lo = strtoul(s, &p, 0);
+                if (p == s) goto choke;
+            }
+            if (*p++ != ']' || *p++ != '=' || hi >= width || lo > hi) goto choke;
+            uint64_t mask = (UINT64_MAX >> (63 - hi + lo)) << lo;
+            s = p;
+            uint64_t data = strtoull(s, &p, 0);
+            if (p == s || *p || data > mask >> lo) goto choke;
+            op->operator = FIELD;
+            op->mask = swapped(mask);
+            op->data = swapped(data << lo);
+            return 1;
+        }
+
+        case '&':
+            if (*p++ != '=' || width > 64) goto choke;
+            op->operator = AND;
+            break;
+
+        case '^':
+            if (*p++ != '=' || width > 64) goto choke;
+            op->operator = XOR;
+            break;
+
+        case '|':
+            if (*p++ != '=' || width > 64) goto choke;
+            op->operator = OR;
+            break;
+
+        case '=':
+            op->operator = WRITE;
+            if (*p != '@') break;
+            if (!*++p || op->count != 1) goto choke;
+            op->file = p;
+            return 1;
+
+        case '?':
+        {
+            if (op->count != 1 || width > 64) goto choke;
+            char *s = p;
+            op->mask = swapped(truncated(strtoull(s, &p, 0)));
+            if (p == s) goto choke;
+            if (*p == '!') op->ne = 1;
+            else if (*p != '=') goto choke;
+            if (*++p != '=') goto choke;
+            p++;
+            op->operator = POLL;
+            break;
         }
 
-        munmap(map, size);
+        default:
+        choke: die("'%s' is invalid\n", arg);
+    }
+
+    // get value
+    value:
+    if (!*p) goto choke;
+    op->data = swapped(truncated(strtoull(p, &p, 0)));
+    if (*p) goto choke;
+    return 1;
+}
+
+// parsing(), tallied for --stats
+static int parse(char *arg, struct op *op)
+{
+    int r;
+    TIMED(PHASE[PARSING], r = parsing(arg, op));
+    return r;
+}
+
+// Poll tuning, set by -s and -t
+static unsigned long spins = 1000, timeout = 1000;
+
+// Spin on the volatile address until the masked value matches (or doesn't), then back off with
+// sleeps doubling from 1uS to 1mS. Die on timeout.
+static void spin(volatile void *address, struct op *op)
+{
+    uint64_t deadline = nsec() + timeout * 1000000ULL;
+
+    poller *poll = kernels(op)->poll;
+
+    // spin in slices of up to 1000 reads, checking the clock in between
+    for (unsigned long n = 0; n < spins; n += 1000)
+    {
+        if (poll(address, (spins - n < 1000) ? spins - n : 1000, op->mask, op->data, op->ne)) return;
+        if (nsec() >= deadline) die("Timeout polling address 0x%" PRIX64 "\n", op->address);
     }
+
+    for (long delay = 1000; !poll(address, 1, op->mask, op->data, op->ne);)
+    {
+        if (nsec() >= deadline) die("Timeout polling address 0x%" PRIX64 "\n", op->address);
+        nanosleep(&(struct timespec){ .tv_nsec = delay }, NULL);
+        if (delay < 1000000) delay *= 2;
+    }
+}
+
+static int compare(const void *a, const void *b)
+{
+    return (*(uint64_t *)a > *(uint64_t *)b) - (*(uint64_t *)a < *(uint64_t *)b);
+}
+
+// Time each access of the address range individually, less the cost of reading the clock, then
+// time a sweep of the whole range. Print latency statistics and bandwidth.
+static void bench(volatile void *address, struct op *op)
+{
+    uint64_t count = op->count, data = op->data, *lat = malloc(count * sizeof(uint64_t)), sink = 0;
+    if (!lat) die("Out of memory\n");
+    uint64_t lanes[4];
+
+    #define ACCESS(type, n) if (op->store) ((volatile type *) address)[n] = data; else sink += ((volatile type *) address)[n]
+    #define WIDE(n) if (op->store) mem_fill(address + (n) * (op->width/8), data, 1, op->width); \
+        else mem_copy(lanes, address + (n) * (op->width/8), 1, op->width)
+    #define SWEEP(from, to) switch(op->width) \
+    { \
+        case  8: for (uint64_t n = from; n < to; n++) ACCESS(uint8_t, n); break; \
+        case 16: for (uint64_t n = from; n < to; n++) ACCESS(uint16_t, n); break; \
+        case 32: for (uint64_t n = from; n < to; n++) ACCESS(uint32_t, n); break; \
+        case 64: for (uint64_t n = from; n < to; n++) ACCESS(uint64_t, n); break; \
+        default: for (uint64_t n = from; n < to; n++) WIDE(n); break; \
+    }
+
+    uint64_t overhead = UINT64_MAX;
+    for (int n = 0; n < 100; n++)
+    {
+        uint64_t t = nsec();
+        t = nsec() - t;
+        if (t < overhead) overhead = t;
+    }
+
+    for (uint64_t n = 0; n < count; n++)
+    {
+        uint64_t t = nsec();
+        SWEEP(n, n + 1);
+        t = nsec() - t;
+        lat[n] = (t > overhead) ? t - overhead : 0;
+    }
+
+    uint64_t t = nsec();
+    SWEEP(0, count);
+    t = nsec() - t;
+
+    #undef SWEEP
+    #undef WIDE
+    #undef ACCESS
+    (void)sink;
+
+    qsort(lat, count, sizeof(uint64_t), compare);
+    outputf("%" PRIu64 " %d-bit %s: min %" PRIu64 " nS, median %" PRIu64 " nS, p99 %" PRIu64 " nS, %.1f MB/S\n",
+            count, op->width, op->store ? "writes" : "reads", lat[0], lat[count / 2], lat[count * 99 / 100],
+            t ? count * (op->width / 8) * 1000.0 / t : 0.0);
+    free(lat);
+}
+
+// Output a value formatted per the width and raw mode
+static void output(uint64_t data, int width, int raw)
+{
+    if (outlen + 32 > OUTBUF) spill();
+    outlen += format(OUT + outlen, data, width, raw);
+}
+
+// Output the address of each match of the value or byte pattern in the range. The range is copied in
+// chunks at the current width, so device memory only sees accesses of that width, then values are
+// compared in place or patterns are located with memmem().
+static void find(volatile void *address, struct op *op)
+{
+    static __thread char buf[(1 << 16) + MAXPATTERN];
+    uint8_t pattern[MAXPATTERN], mask[MAXPATTERN];
+    int len = 0, masked = 0;
+    if (op->pattern)
+    {
+        char *p;
+        len = unhex(op->pattern, &p, pattern);
+        memset(mask, 0xFF, len);
+        if (*p) unhex(p + 2, &p, mask);
+        for (int n = 0; n < len; n++) masked |= mask[n] != 0xFF;
+    }
+
+    uint64_t bytes = op->count * (op->width/8), step = op->width/8, keep = 0;
+    for (uint64_t offset = 0; offset < bytes; offset += sizeof(buf) - MAXPATTERN)
+    {
+        uint64_t chunk = (bytes - offset < sizeof(buf) - MAXPATTERN) ? bytes - offset : sizeof(buf) - MAXPATTERN;
+        mem_copy(buf + keep, address + offset, chunk / step, op->width);
+        uint64_t have = keep + chunk, base = op->address + offset - keep;
+
+        if (!op->pattern && op->width == 8 && op->mask == 0xFF)
+        {
+            for (char *m = buf; (m = memchr(m, op->data, buf + have - m)); m++) output(base + (m - buf), 64, op->raw);
+            continue;
+        }
+
+        if (!op->pattern)
+        {
+            for (uint64_t n = 0; n < have; n += step)
+                if ((mem_peek(buf + n, op->width) & op->mask) == op->data) output(base + n, 64, op->raw);
+            continue;
+        }
+
+        for (uint64_t n = 0; n + len <= have; n++)
+        {
+            if (!masked)
+            {
+                char *m = memmem(buf + n, have - n, pattern, len);
+                if (!m) break;
+                n = m - buf;
+            }
+            else
+            {
+                int i = 0;
+                while (i < len && !((buf[n + i] ^ pattern[i]) & mask[i])) i++;
+                if (i < len) continue;
+            }
+            output(base + n, 64, op->raw);
+        }
+
+        // keep the tail, in case a match straddles chunks
+        keep = (have < len - 1) ? have : len - 1;
+        memmove(buf, buf + have - keep, keep);
+    }
+}
+
+// CRC32C (Castagnoli), with the SSE4.2 or ARMv8 CRC instructions if available, otherwise a table
+static uint32_t crc32ctable(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    static uint32_t table[256];
+    if (!table[1])
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+            table[n] = c;
+        }
+    while (len--) crc = (crc >> 8) ^ table[(crc ^ *buf++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32chw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t c = crc;
+    for (; len >= 8; buf += 8, len -= 8) c = __builtin_ia32_crc32di(c, *(uint64_t *)buf);
+    crc = c;
+    for (; len; buf++, len--) crc = __builtin_ia32_crc32qi(crc, *buf);
+    return crc;
+}
+#define CRC32C __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static uint32_t crc32chw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    for (; len >= 8; buf += 8, len -= 8) crc = __crc32cd(crc, *(uint64_t *)buf);
+    for (; len; buf++, len--) crc = __crc32cb(crc, *buf);
+    return crc;
+}
+#define CRC32C 1
+#else
+#define CRC32C 0
+#define crc32chw crc32ctable
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    static int hw = -1;
+    if (hw < 0) hw = CRC32C;
+    return ~(hw ? crc32chw : crc32ctable)(~crc, buf, len);
+}
+
+// XXH64, streamed a multiple of 32 bytes at a time
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+struct xxh64 { uint64_t v[4], total; };
+
+static uint64_t xxhround(uint64_t acc, uint64_t lane)
+{
+    acc += lane * P2;
+    return ROTL(acc, 31) * P1;
+}
+
+static uint64_t xxhmerge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxhround(0, v)) * P1 + P4;
+}
+
+static void xxhinit(struct xxh64 *x)
+{
+    *x = (struct xxh64){ { P1 + P2, P2, 0, -P1 }, 0 };
+}
+
+// Hash the stripes, return the number of bytes consumed
+static size_t xxhupdate(struct xxh64 *x, const uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+    for (; n + 32 <= len; n += 32)
+        for (int k = 0; k < 4; k++)
+        {
+            uint64_t lane;
+            memcpy(&lane, buf + n + k * 8, 8);
+            x->v[k] = xxhround(x->v[k], lane);
+        }
+    x->total += n;
+    return n;
+}
+
+// Hash the final, partial stripe
+static uint64_t xxhfinal(struct xxh64 *x, const uint8_t *buf, size_t len)
+{
+    uint64_t h, *v = x->v;
+    if (x->total >= 32)
+    {
+        h = ROTL(v[0], 1) + ROTL(v[1], 7) + ROTL(v[2], 12) + ROTL(v[3], 18);
+        for (int k = 0; k < 4; k++) h = xxhmerge(h, v[k]);
+    }
+    else h = v[2] + P5; // the seed is 0
+    h += x->total + len;
+
+    for (; len >= 8; buf += 8, len -= 8)
+    {
+        uint64_t lane;
+        memcpy(&lane, buf, 8);
+        h = ROTL(h ^ xxhround(0, lane), 27) * P1 + P4;
+    }
+    if (len >= 4)
+    {
+        uint32_t lane;
+        memcpy(&lane, buf, 4);
+        h = ROTL(h ^ (lane * P1), 23) * P2 + P3;
+        buf += 4;
+        len -= 4;
+    }
+    for (; len; buf++, len--) h = ROTL(h ^ (*buf * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    return h ^ (h >> 32);
+}
+
+// Output the CRC32C or XXH64 of the range. The range is copied in chunks at the current width, so
+// device memory only sees accesses of that width, and is hashed as the bytes it contains.
+static void digest(volatile void *address, struct op *op)
+{
+    static __thread uint8_t buf[1 << 16];
+    uint64_t bytes = op->count * (op->width/8), step = op->width/8;
+    uint32_t crc = 0;
+    struct xxh64 x;
+    xxhinit(&x);
+
+    for (uint64_t offset = 0; offset < bytes; offset += sizeof(buf))
+    {
+        uint64_t chunk = (bytes - offset < sizeof(buf)) ? bytes - offset : sizeof(buf);
+        mem_copy(buf, address + offset, chunk / step, op->width);
+        if (op->operator == CRC) crc = crc32c(crc, buf, chunk);
+        else if (xxhupdate(&x, buf, chunk) < chunk) output(xxhfinal(&x, buf + (chunk & ~31), chunk & 31), 64, op->raw);
+    }
+
+    // a chunk that's a multiple of 32 leaves nothing for xxhfinal()
+    if (op->operator == CRC) output(crc, 32, op->raw);
+    else if (!(bytes & 31)) output(xxhfinal(&x, NULL, 0), 64, op->raw);
+}
+
+// Set by -m
+static uint64_t mismatches = 1;
+
+// Format a native value of the width from buf as hex text followed by end
+static int formatwith(char *out, const void *buf, int width, char end)
+{
+    uint64_t lanes[4];
+    memcpy(lanes, buf, width/8);
+    int len = (width > 64) ? formatwide(out, lanes, width, 0) : format(out, mem_peek(lanes, width), width, 0);
+    out[len - 1] = end;
+    return len;
+}
+
+// Compare consecutive addresses with the contents of a file. The file is mapped and the range is
+// copied in chunks at the current width, each chunk is compared with memcmp() and only searched for
+// the mismatching values if it differs. Output "address memory file" for each of the first -m
+// mismatches, then die.
+static void verify(struct op *op)
+{
+    static __thread uint8_t buf[1 << 16];
+    int step = op->width/8;
+    int f = open(op->file, O_RDONLY);
+    if (f < 0) die("Can't open %s: %s\n", op->file, strerror(errno));
+    struct stat st;
+    if (fstat(f, &st) || !S_ISREG(st.st_mode)) die("%s is not a file\n", op->file);
+    uint64_t bytes = st.st_size;
+    if (bytes % step) die("%s length is not a multiple of %d bits\n", op->file, op->width);
+    if (!bytes) return;
+    uint8_t *file = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, f, 0);
+    if (file == MAP_FAILED) die("Can't map %s: %s\n", op->file, strerror(errno));
+    close(f);
+
+    volatile void *address = map(op->address, bytes, op->cached);
+    uint64_t found = 0, first = 0;
+    for (uint64_t offset = 0; offset < bytes; offset += sizeof(buf))
+    {
+        uint64_t chunk = (bytes - offset < sizeof(buf)) ? bytes - offset : sizeof(buf);
+        mem_copy(buf, address + offset, chunk / step, op->width);
+        if (op->swap) for (uint64_t n = 0; n < chunk; n += step) switch(op->width)
+        {
+            case 16: *(uint16_t *)(buf + n) = bswap_16(*(uint16_t *)(buf + n)); break;
+            case 32: *(uint32_t *)(buf + n) = bswap_32(*(uint32_t *)(buf + n)); break;
+            case 64: *(uint64_t *)(buf + n) = bswap_64(*(uint64_t *)(buf + n)); break;
+        }
+        if (!memcmp(buf, file + offset, chunk)) continue;
+
+        for (uint64_t n = 0; n < chunk; n += step)
+        {
+            if (!memcmp(buf + n, file + offset + n, step)) continue;
+            if (!found++) first = op->address + offset + n;
+            if (found > mismatches) break;
+            char line[3 * 68];
+            int len = formatwith(line, &(uint64_t){op->address + offset + n}, 64, ' ');
+            len += formatwith(line + len, buf + n, op->width, ' ');
+            len += formatwith(line + len, file + offset + n, op->width, '\n');
+            outputf("%.*s", len, line);
+        }
+        if (found >= mismatches) break;
+    }
+    munmap(file, bytes);
+    if (found) die("Verify failed at address 0x%" PRIX64 "\n", first);
+}
+
+// Parallel dumps, set by -j and -n
+static int jobs = 1, numa = 0;
+
+// Ranges are split into chunks of this many bytes
+#define CHUNK (1 << 22)
+
+// Return the NUMA node that owns the physical address, or -1 if it isn't known RAM
+static int node(uint64_t address)
+{
+    static uint64_t block;
+    if (!block)
+    {
+        FILE *f = fopen("/sys/devices/system/memory/block_size_bytes", "r");
+        if (!f || fscanf(f, "%" SCNx64, &block) != 1 || !block) block = UINT64_MAX;
+        if (f) fclose(f);
+    }
+    if (block == UINT64_MAX) return -1;
+
+    char path[80];
+    snprintf(path, sizeof(path), "/sys/devices/system/memory/memory%" PRIu64, address / block);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int n = -1;
+    for (struct dirent *e; n < 0 && (e = readdir(d));)
+        if (sscanf(e->d_name, "node%d", &n) != 1) n = -1;
+    closedir(d);
+    return n;
+}
+
+// Run the calling thread on the CPUs of the NUMA node
+static void pin(int node)
+{
+    char path[80];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+
+    // cpulist is like "0-3,8-11"
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int first, last; fscanf(f, "%d", &first) == 1;)
+    {
+        int c = fgetc(f);
+        last = first;
+        if (c == '-' && fscanf(f, "%d", &last) == 1) c = fgetc(f);
+        while (first <= last && first < CPU_SETSIZE) CPU_SET(first++, &set);
+        if (c != ',') break;
+    }
+    fclose(f);
+    if (CPU_COUNT(&set)) sched_setaffinity(0, sizeof(set), &set);
+}
+
+// The parallel dump in progress
+static struct
+{
+    struct op *op;
+    struct mem *m;  // cloned by each worker
+    off_t base;     // stdout offset of the first value
+    uint64_t chunks;
+    uint64_t next;  // next chunk to claim
+    // with -z, each chunk's LZ4 blocks, which are written in order as they complete
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t written; // chunks written
+    struct { uint8_t *buf; size_t len; int done; } *out;
+} JOB = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// With -z, claim a chunk no more than 2 per thread ahead of the chunk being written, so memory stays
+// bounded when stdout is slow. Return UINT64_MAX when there are no more.
+static uint64_t claim(void)
+{
+    if (!compress)
+    {
+        uint64_t c = __atomic_fetch_add(&JOB.next, 1, __ATOMIC_RELAXED);
+        return (c < JOB.chunks) ? c : UINT64_MAX;
+    }
+    pthread_mutex_lock(&JOB.lock);
+    while (JOB.next < JOB.chunks && JOB.next >= JOB.written + 2 * jobs) pthread_cond_wait(&JOB.cond, &JOB.lock);
+    uint64_t c = (JOB.next < JOB.chunks) ? JOB.next++ : UINT64_MAX;
+    pthread_mutex_unlock(&JOB.lock);
+    return c;
+}
+
+// Claim chunks, map each one with a private handle, and write its output to that chunk's position in
+// stdout, or with -z compress it for parallel() to write
+static void *worker(void *unused)
+{
+    struct op *op = JOB.op;
+    uint64_t bytes = op->count * (op->width/8), size = OUTSIZE(op->width, op->raw);
+    char *buf = malloc(OUTBUF);
+    if (!buf) die("Out of memory\n");
+    struct mem *m = mem_clone(JOB.m);
+    if (!m) die("Can't open %s: %s\n", device ?: "/dev/mem", strerror(errno));
+
+    int pinned = -1;
+    for (uint64_t c; (c = claim()) != UINT64_MAX;)
+    {
+        uint64_t first = c * CHUNK, len = (bytes - first < CHUNK) ? bytes - first : CHUNK;
+        uint64_t address = op->address + first;
+
+        if (numa)
+        {
+            int n = node(address);
+            if (n >= 0 && n != pinned) pin(pinned = n);
+        }
+
+        void *p = mem_map(m, address, len, op->cached ? MEM_CACHED : 0);
+        if (!p) die("Can't map address 0x%" PRIX64 ": %s\n", address, strerror(errno));
+
+        uint64_t values = len / (op->width/8);
+        off_t out = JOB.base + (first / (op->width/8)) * size;
+        uint8_t *z = NULL;
+        size_t zlen = 0;
+        for (uint64_t n = 0, chunk; n < values; n += chunk)
+        {
+            chunk = (values - n < OUTBUF / size) ? values - n : OUTBUF / size;
+            size_t l = dump(buf, p + n * (op->width/8), chunk, op);
+            if (compress)
+            {
+                if (!(z = realloc(z, zlen + BLOCK + 4))) die("Out of memory\n");
+                zlen += block(z + zlen, buf, l);
+                continue;
+            }
+            for (size_t w = 0; w < l;)
+            {
+                ssize_t r = pwrite(1, buf + w, l - w, out + w);
+                if (r < 0 && errno != EINTR) die("Can't write output: %s\n", strerror(errno));
+                if (r > 0) w += r;
+            }
+            out += l;
+        }
+
+        if (compress)
+        {
+            pthread_mutex_lock(&JOB.lock);
+            JOB.out[c].buf = z;
+            JOB.out[c].len = zlen;
+            JOB.out[c].done = 1;
+            pthread_cond_broadcast(&JOB.cond);
+            pthread_mutex_unlock(&JOB.lock);
+        }
+    }
+    release(m);
+    free(buf);
+    return unused;
+}
+
+// Dump a range of more than one chunk with a thread per job. Return 0 if stdout can't take positional
+// writes (e.g. it's a pipe), in which case the caller must dump it serially.
+static int parallel(struct op *op)
+{
+    uint64_t bytes = op->count * (op->width/8);
+    if (bytes <= CHUNK) return 0;
+
+    flush();
+    int flags = fcntl(1, F_GETFL);
+    off_t base = lseek(1, 0, SEEK_CUR);
+    if (!compress && (flags < 0 || (flags & O_APPEND) || base < 0)) return 0;
+
+    JOB.op = op;
+    JOB.m = M;
+    JOB.base = base;
+    JOB.chunks = (bytes + CHUNK - 1) / CHUNK;
+    JOB.next = JOB.written = 0;
+    if (compress && !(JOB.out = calloc(JOB.chunks, sizeof(*JOB.out)))) die("Out of memory\n");
+
+    pthread_t thread[jobs];
+    for (int j = 0; j < jobs; j++)
+        if ((errno = pthread_create(&thread[j], NULL, worker, NULL))) die("Can't create thread: %s\n", strerror(errno));
+
+    if (compress)
+    {
+        frame();
+        for (uint64_t c = 0; c < JOB.chunks; c++)
+        {
+            pthread_mutex_lock(&JOB.lock);
+            while (!JOB.out[c].done) pthread_cond_wait(&JOB.cond, &JOB.lock);
+            pthread_mutex_unlock(&JOB.lock);
+            put((char *)JOB.out[c].buf, JOB.out[c].len);
+            free(JOB.out[c].buf);
+            pthread_mutex_lock(&JOB.lock);
+            JOB.written++;
+            pthread_cond_broadcast(&JOB.cond);
+            pthread_mutex_unlock(&JOB.lock);
+        }
+        free(JOB.out);
+    }
+
+    for (int j = 0; j < jobs; j++) pthread_join(thread[j], NULL);
+
+    // leave stdout after the dump
+    if (!compress) lseek(1, base + op->count * OUTSIZE(op->width, op->raw), SEEK_SET);
+    return 1;
+}
+
+// Copy the range of a read to the snapshot, as a region padded to MEM_SNAPSHOT_HEADER bytes
+static void save(struct op *op)
+{
+    static char buf[OUTBUF];
+    uint64_t bytes = op->count * (op->width/8), step = op->width/8;
+    region(MEM_READ, op, bytes);
+
+    volatile void *address = map(op->address, bytes, op->cached);
+    for (uint64_t offset = 0; offset < bytes; offset += sizeof(buf))
+    {
+        uint64_t chunk = (bytes - offset < sizeof(buf)) ? bytes - offset : sizeof(buf);
+        mem_copy(buf, address + offset, chunk / step, op->width);
+        store(buf, chunk);
+    }
+    pad();
+}
+
+// Record a barrier, write, AND, OR, XOR or field update in the snapshot, before it's performed.
+// Writes are recorded as the bytes written, the others as their operands in memory order.
+static void note(struct op *op)
+{
+    static char buf[OUTBUF];
+    uint64_t bytes = op->count * (op->width/8), step = op->width/8;
+    switch(op->operator)
+    {
+        case FENCE:
+            region(MEM_FENCE, op, 0);
+            return;
+
+        case WRITE:
+            if (op->file) return; // load() records the file's contents
+            region(MEM_WRITE, op, bytes);
+            mem_fill(buf, op->data, sizeof(buf) / step, op->width);
+            for (uint64_t offset = 0; offset < bytes; offset += sizeof(buf))
+                store(buf, (bytes - offset < sizeof(buf)) ? bytes - offset : sizeof(buf));
+            break;
+
+        case AND:
+        case OR:
+        case XOR:
+        case FIELD:
+            // the count is 32-bit, so a larger range is several regions
+            for (uint64_t n = 0; n < op->count; n += UINT32_MAX)
+            {
+                struct op part = *op;
+                part.address += n * step;
+                part.count = (op->count - n < UINT32_MAX) ? op->count - n : UINT32_MAX;
+                region((op->operator == FIELD) ? MEM_FIELD : op->operator, &part, (op->operator == FIELD) ? 16 : 8);
+                store(&op->data, 8);
+                if (op->operator == FIELD) store(&op->mask, 8);
+                pad();
+            }
+            break;
+
+        default:
+            return;
+    }
+    pad();
+    if (!op->batch) region(MEM_FENCE, op, 0); // performed after it, see operation()
+}
+
+// The table of the snapshot being replayed
+static __thread const struct mem_region *TABLE;
+
+// Order regions by address, or by 2 MiB window, then by their order in the table
+static int byaddress(const void *a, const void *b)
+{
+    const struct mem_region *x = &TABLE[*(uint64_t *)a], *y = &TABLE[*(uint64_t *)b];
+    if (x->address != y->address) return (x->address > y->address) - (x->address < y->address);
+    return (*(uint64_t *)a > *(uint64_t *)b) - (*(uint64_t *)a < *(uint64_t *)b);
+}
+
+#define WINDOW(r) ((r)->address >> 21)
+static int bywindow(const void *a, const void *b)
+{
+    const struct mem_region *x = &TABLE[*(uint64_t *)a], *y = &TABLE[*(uint64_t *)b];
+    if (WINDOW(x) != WINDOW(y)) return (WINDOW(x) > WINDOW(y)) - (WINDOW(x) < WINDOW(y));
+    return (*(uint64_t *)a > *(uint64_t *)b) - (*(uint64_t *)a < *(uint64_t *)b);
+}
+
+// Return the bytes of memory a region covers
+static uint64_t span(const struct mem_region *r)
+{
+    return r->count ? r->count * (uint64_t)(r->width/8) : r->length;
+}
+
+// Sort count region indexes by window, keeping their order within a window. Regions that overlap
+// must stay in order, so this is only done if none overlap across windows, otherwise the indexes are
+// left in order.
+static void group(uint64_t *order, uint64_t count)
+{
+    qsort(order, count, sizeof(uint64_t), byaddress);
+    // the end of the regions in earlier windows, and in the current one
+    uint64_t before = 0, end = 0, window = UINT64_MAX;
+    for (uint64_t n = 0; n < count; n++)
+    {
+        const struct mem_region *r = &TABLE[order[n]];
+        if (WINDOW(r) != window)
+        {
+            if (end > before) before = end;
+            end = 0;
+            window = WINDOW(r);
+        }
+        if (r->address < before)
+        {
+            qsort(order, count, sizeof(uint64_t), compare);
+            return;
+        }
+        if (r->address + span(r) > end) end = r->address + span(r);
+    }
+    qsort(order, count, sizeof(uint64_t), bywindow);
+}
+
+// Perform a region of the snapshot
+static void perform(const struct mem_region *r, const uint8_t *snapshot, uint64_t size)
+{
+    struct op op = { .operator = r->opcode, .width = r->width, .address = r->address, .cached = r->flags & MEM_CACHED };
+    if (op.width < 8 || op.width > 256 || (op.width & (op.width - 1)) || r->length % (op.width/8) ||
+        ((r->opcode == MEM_READ || r->opcode == MEM_WRITE) ? r->count : (op.width > 64 || !r->count ||
+        r->length != ((r->opcode == MEM_FIELD) ? 16 : 8))) || r->offset > size - r->length)
+        die("Invalid region at 0x%" PRIX64 "\n", r->address);
+    op.count = r->count ? r->count : r->length / (op.width/8);
+
+    void *address = map(op.address, span(r), op.cached);
+    uint64_t mask;
+    switch(r->opcode)
+    {
+        case MEM_READ:
+        case MEM_WRITE:
+            mem_copy(address, snapshot + r->offset, op.count, op.width);
+            break;
+
+        case MEM_AND:
+        case MEM_OR:
+        case MEM_XOR:
+            memcpy(&op.data, snapshot + r->offset, 8);
+            kernelof(&op)(NULL, address, op.count, op.data);
+            break;
+
+        case MEM_FIELD:
+            memcpy(&op.data, snapshot + r->offset, 8);
+            memcpy(&mask, snapshot + r->offset + 8, 8);
+            kernels(&op)->field(address, op.count, mask, op.data);
+            break;
+
+        default:
+            die("Invalid region at 0x%" PRIX64 "\n", r->address);
+    }
+}
+
+// Perform the regions of a snapshot in order: write back captured reads, and repeat recorded writes,
+// ANDs, ORs, XORs, field updates and barriers. Between barriers, regions are grouped by mapping
+// window where that doesn't reorder overlapping regions, and a barrier is only performed where one
+// was recorded, and at the end.
+static void replay(struct op *op)
+{
+    if (!mem_mappable(M)) die("Can't replay to %s\n", device);
+    int f = open(op->file, O_RDONLY);
+    if (f < 0) die("Can't open %s: %s\n", op->file, strerror(errno));
+    struct stat st;
+    if (fstat(f, &st) || !S_ISREG(st.st_mode)) die("%s is not a file\n", op->file);
+    uint8_t *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+    if (p == MAP_FAILED) die("Can't map %s: %s\n", op->file, strerror(errno));
+    close(f);
+    uint64_t count;
+    if (!(TABLE = mem_table(p, st.st_size, &count))) die("%s is not a snapshot\n", op->file);
+
+    uint64_t *order = malloc(count * sizeof(uint64_t) + 1);
+    if (!order) die("Out of memory\n");
+    for (uint64_t first = 0, last; first < count; first = last + 1)
+    {
+        for (last = first; last < count && TABLE[last].opcode != MEM_FENCE; last++) order[last - first] = last;
+        group(order, last - first);
+        for (uint64_t n = 0; n < last - first; n++) perform(&TABLE[order[n]], p, st.st_size);
+        if (last < count) mem_fence(TABLE[last].flags & 1);
+    }
+    mem_fence(0);
+    free(order);
+    munmap(p, st.st_size);
+}
+
+// Perform a read, write, AND, OR, XOR or field update on a device that can't be mapped, one value at
+// a time
+static void unmapped(struct op *op)
+{
+    if ((op->operator > XOR && op->operator != FIELD) || op->file || op->width > 64)
+        die("%s only supports reads, writes, AND, OR, XOR and field updates\n", device);
+    // operands are already in memory order, only a value read is swapped for output
+    for (uint64_t n = 0; n < op->count; n++)
+    {
+        uint64_t address = op->address + n * (op->width/8), data;
+        int e = (op->operator == FIELD)
+            ? mem_rmw(M, address, op->width, READ, 0, 0, &data) ||
+              mem_rmw(M, address, op->width, WRITE, (data & ~op->mask) | op->data, 0, NULL)
+            : mem_rmw(M, address, op->width, op->operator, op->data, (op->operator == READ && op->swap) ? MEM_SWAP : 0, &data);
+        if (e) die("Can't access address 0x%" PRIX64 ": %s\n", address, strerror(errno));
+        if (op->operator == READ) output(data, op->width, op->raw);
+    }
+}
+
+// Perform an operation
+static void operation(struct op *op)
+{
+    if (capture && op->operator != READ) note(op);
+
+    if (op->operator == FENCE)
+    {
+        mem_fence(op->store);
+        return;
+    }
+
+    if (op->operator == READ && capture)
+    {
+        save(op);
+        return;
+    }
+
+    if (!mem_mappable(M))
+    {
+        unmapped(op);
+        return;
+    }
+
+    if (op->operator == VERIFY)
+    {
+        verify(op);
+        return;
+    }
+
+    if (op->operator == REPLAY)
+    {
+        replay(op);
+        return;
+    }
+
+    if (op->file)
+    {
+        load(op);
+        if (!op->batch) mem_fence(0);
+        return;
+    }
+
+    if (op->operator == READ && jobs > 1 && !grouped && parallel(op)) return;
+
+    void *address = map(op->address, op->count * (op->width/8), op->cached);
+    uint64_t count = op->count, data = op->data;
+    kernel *k = kernelof(op);
+
+    switch(op->operator)
+    {
+        case READ:
+            for (uint64_t n = 0, size = OUTSIZE(op->width, op->raw); n < count;)
+            {
+                if (outlen + size > OUTBUF) spill();
+                uint64_t chunk = (OUTBUF - outlen) / size;
+                if (chunk > count - n) chunk = count - n;
+                outlen += k(OUT + outlen, address + n * (op->width/8), chunk, 0);
+                n += chunk;
+            }
+            break;
+
+        case WRITE:
+        case AND:
+        case OR:
+        case XOR:
+            k(NULL, address, count, data);
+            break;
+
+        case FIELD:
+            kernels(op)->field(address, count, op->mask, data);
+            break;
+
+        case POLL:
+            spin(address, op);
+            return;
+
+        case BENCH:
+            bench(address, op);
+            return;
+
+        case FIND:
+            find(address, op);
+            return;
+
+        case CRC:
+        case XXH:
+            digest(address, op);
+            return;
+    }
+
+    if (op->operator != READ && !op->batch) mem_fence(0);
+}
+
+// Perform a group's operations, on its own thread
+static void *run(void *arg)
+{
+    grouped = arg;
+    M = grouped->m;
+    if (!(OUT = malloc(OUTBUF))) die("Out of memory\n");
+    for (size_t n = 0; n < grouped->count; n++) TIMED(OPERATION[grouped->ops[n].operator], operation(&grouped->ops[n]));
+    spill();
+    free(OUT);
+    return NULL;
+}
+
+// Wait for the running groups and write their output in order
+static void join(void)
+{
+    for (size_t n = 0; n < ngroups; n++)
+    {
+        struct group *g = groups[n];
+        pthread_join(g->thread, NULL);
+        flush();
+        emit(g->out, g->len);
+        release(g->m);
+        for (size_t o = 0; o < g->count; o++) free(g->ops[o].file), free(g->ops[o].pattern);
+        free(g->ops);
+        free(g->out);
+        free(g);
+    }
+    ngroups = 0;
+}
+
+// Perform an operation, or add it to the group being collected, or start the group at its "}"
+static void execute(struct op *op)
+{
+    if (op->group && !collecting && !(collecting = calloc(1, sizeof(struct group)))) die("Out of memory\n");
+    if (op->operator == GROUP)
+    {
+        if (capture) die("-S can't be used with groups\n");
+        if (!ngroups) flush(); // so nothing is lost if a group fails
+        if (!(ngroups & (ngroups + 1)) && !(groups = realloc(groups, (ngroups + 1) * 2 * sizeof(struct group *))))
+            die("Out of memory\n");
+        if (!(collecting->m = mem_clone(M))) die("Can't open %s: %s\n", device ?: "/dev/mem", strerror(errno));
+        if (pthread_create(&collecting->thread, NULL, run, collecting)) die("Can't create thread\n");
+        groups[ngroups++] = collecting;
+        collecting = NULL;
+    }
+    else if (op->group)
+    {
+        struct group *g = collecting;
+        if (!(g->count & (g->count + 1)) && !(g->ops = realloc(g->ops, (g->count + 1) * 2 * sizeof(struct op))))
+            die("Out of memory\n");
+        // the names point into the argument, which may be a line of the file that's about to be reused
+        struct op *o = &g->ops[g->count++];
+        *o = *op;
+        if ((o->file && !(o->file = strdup(o->file))) || (o->pattern && !(o->pattern = strdup(o->pattern))))
+            die("Out of memory\n");
+    }
+    else
+    {
+        join();
+        TIMED(OPERATION[op->operator], operation(op));
+    }
+}
+
+// Sampling, set by -r, -c and -d
+static double rate;
+static uint64_t samples;
+static int changes;
+
+// Set by SIGINT or SIGTERM while sampling
+static volatile sig_atomic_t stop;
+static void interrupt(int sig) { stop = 1; }
+
+// Samples are written to a ring buffer, which a separate thread drains to stdout, so that output
+// doesn't disturb the sample timing
+#define RING (1 << 24)
+static struct
+{
+    char *buf;
+    uint64_t head, tail; // total bytes added by the sampler and removed by the writer
+    int done;
+} RB;
+
+static void *writer(void *unused)
+{
+    while (1)
+    {
+        uint64_t head = __atomic_load_n(&RB.head, __ATOMIC_ACQUIRE), tail = RB.tail;
+        if (head == tail)
+        {
+            if (__atomic_load_n(&RB.done, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&RB.head, __ATOMIC_ACQUIRE)) break;
+            nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+            continue;
+        }
+        size_t offset = tail % RING, len = (head - tail < RING - offset) ? head - tail : RING - offset;
+        emit(RB.buf + offset, len);
+        __atomic_store_n(&RB.tail, tail + len, __ATOMIC_RELEASE);
+    }
+    return unused;
+}
+
+// Read a sample and format it as a record. Return the end of the record.
+static char *full(char *p, uint64_t now, struct op *ops, void **mapped, int count)
+{
+    if (ops[0].raw)
+    {
+        memcpy(p, &now, 8);
+        p += 8;
+    }
+    else p += sprintf(p, "%" PRIu64 ",", now);
+    char *values = p;
+    for (int n = 0; n < count; n++)
+        p += dump(p, mapped[n], ops[n].count, &ops[n]);
+    if (!ops[0].raw)
+    {
+        // hex is one value per line, make it one sample per line
+        for (char *c = values; c < p; c++) if (*c == '\n') *c = ',';
+        p[-1] = '\n';
+    }
+    return p;
+}
+
+// Read a sample into the current snapshot and format a record for each value that differs from the
+// previous snapshot (or for every value if first is set). Return the end of the records.
+static char *difference(char *p, uint64_t now, struct op *ops, void **mapped, int count, char *previous, char *current, int first)
+{
+    uint64_t offset = 0;
+    for (int n = 0; n < count; n++)
+    {
+        struct op *op = &ops[n];
+        uint64_t bytes = op->count * (op->width/8), step = op->width/8;
+        mem_copy(current + offset, mapped[n], op->count, op->width);
+
+        // compare in 64-byte blocks with memcmp, it's much faster than value by value
+        for (uint64_t block = 0; block < bytes; block += 64)
+        {
+            uint64_t len = (bytes - block < 64) ? bytes - block : 64;
+            if (!first && !memcmp(previous + offset + block, current + offset + block, len)) continue;
+            for (uint64_t v = block; v < block + len; v += step)
+            {
+                char *old = previous + offset + v, *new = current + offset + v;
+                if (!first && !memcmp(old, new, step)) continue;
+                uint64_t address = op->address + v;
+                if (op->raw)
+                {
+                    memcpy(p, &now, 8);
+                    memcpy(p + 8, &address, 8);
+                    p += 16;
+                    p += dump(p, first ? new : old, 1, op);
+                    p += dump(p, new, 1, op);
+                }
+                else
+                {
+                    p += sprintf(p, "%" PRIu64 ",0x%" PRIX64 ",", now, address);
+                    p += dump(p, first ? new : old, 1, op);
+                    p[-1] = ',';
+                    p += dump(p, new, 1, op);
+                }
+            }
+        }
+        offset += bytes;
+    }
+    return p;
+}
+
+// Perform the reads at the sample rate until the sample count or a signal, and output each sample
+// with its timestamp
+static void sample(struct op *ops, int count)
+{
+    // with -d, the snapshot holds the previous sample's values, followed by space for the current
+    size_t size = ops[0].raw ? 8 : 21, snap = 0;
+    for (int n = 0; n < count; n++)
+    {
+        if (ops[n].operator != READ) die("Only reads can be sampled\n");
+        if (ops[n].raw != ops[0].raw) die("Sampled reads must be all raw or all hex\n");
+        // a -d record per value is the timestamp, address, and two values
+        int out = OUTSIZE(ops[n].width, ops[n].raw);
+        size += ops[n].count * (changes ? (ops[0].raw ? 16 : 40) + out * 2 : out);
+        snap += ops[n].count * (ops[n].width/8);
+    }
+    if (size > RING / 4) die("Sample is too large\n");
+
+    char *record = malloc(size), *snapshot = changes ? malloc(snap * 2) : NULL;
+    RB.buf = malloc(RING);
+    if (!record || !RB.buf || (changes && !snapshot)) die("Out of memory\n");
+    char *previous = snapshot, *current = snapshot + snap;
+
+    // each operation gets a handle of its own, so its mapping is made once and never evicted
+    struct mem **handles = malloc(count * sizeof(struct mem *));
+    void **mapped = malloc(count * sizeof(void *));
+    if (!handles || !mapped) die("Out of memory\n");
+    for (int n = 0; n < count; n++)
+    {
+        if (!(handles[n] = mem_clone(M))) die("Can't open %s: %s\n", device ?: "/dev/mem", strerror(errno));
+        TIMED(PHASE[MAPPING], mapped[n] = mem_map(handles[n], ops[n].address, ops[n].count * (ops[n].width/8), ops[n].cached ? MEM_CACHED : 0));
+        if (!mapped[n]) die("Can't map address 0x%" PRIX64 ": %s\n", ops[n].address, strerror(errno));
+    }
+
+    flush();
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, writer, NULL))) die("Can't create thread: %s\n", strerror(errno));
+
+    // short periods busy-wait, longer ones sleep until the deadline
+    uint64_t period = 1e9 / rate, next = nsec();
+    for (uint64_t s = 0; !stop && (!samples || s < samples); s++, next += period)
+    {
+        if (period >= 100000)
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                            &(struct timespec){ .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 }, NULL);
+        uint64_t now;
+        while ((now = nsec()) < next);
+        if (now - next > period) next = now; // fell behind, don't try to catch up
+
+        char *p = changes ? difference(record, now, ops, mapped, count, previous, current, !s) : full(record, now, ops, mapped, count);
+        if (changes)
+        {
+            char *t = previous;
+            previous = current;
+            current = t;
+        }
+
+        size_t len = p - record, offset = RB.head % RING;
+        if (RB.head + len - __atomic_load_n(&RB.tail, __ATOMIC_ACQUIRE) > RING) die("Sample buffer overrun\n");
+        if (len > RING - offset)
+        {
+            memcpy(RB.buf + offset, record, RING - offset);
+            memcpy(RB.buf, record + RING - offset, len - (RING - offset));
+        }
+        else memcpy(RB.buf + offset, record, len);
+        __atomic_store_n(&RB.head, RB.head + len, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&RB.done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    for (int n = 0; n < count; n++) release(handles[n]);
+    free(handles);
+    free(mapped);
+    free(snapshot);
+    free(record);
+}
+
+// Perform operations read from a file, "-" is stdin
+static void script(char *name, int lines)
+{
+    FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    if (!f) die("Can't open %s: %s\n", name, strerror(errno));
+
+    char *line = NULL;
+    size_t size = 0;
+    struct op op;
+    while (getline(&line, &size, f) >= 0)
+    {
+        // a comment starts with a '#' at the start of a token, elsewhere it's part of a find: pattern
+        for (char *p = line; (p = strchr(p, '#')); p++)
+            if (p == line || isspace((unsigned char)p[-1]))
+            {
+                *p = 0;
+                break;
+            }
+        for (char *arg = strtok(line, " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n"))
+            if (parse(arg, &op)) execute(&op);
+        if (lines)
+        {
+            join();
+            flush();
+        }
+    }
+    if (ferror(f)) die("Can't read %s: %s\n", name, strerror(errno));
+    if (batch) die("Unterminated '['\n");
+    if (grouping) die("Unterminated '{'\n");
+    free(line);
+    if (f != stdin) fclose(f);
+}
+
+// Server protocol, see usage(). Everything is little-endian.
+struct request
+{
+    uint8_t operator, width, flags, reserved[5];
+    uint64_t address, data;
+};
+
+#define MAXRECORDS 65536
+#define MAXCLIENTS 64
+
+// A client that stalls part way through a message for this long is dropped, so it can't hold up the
+// others
+#define CLIENTTIMEOUT 1
+
+// Read or write exactly len bytes, return 0 if the connection closed or failed
+static int transfer(int s, void *buf, size_t len, int out)
+{
+    for (size_t n = 0; n < len;)
+    {
+        ssize_t r = out ? send(s, buf + n, len - n, 0) : recv(s, buf + n, len - n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        n += r;
+    }
+    return 1;
+}
+
+// Perform one request message from the client, return 0 if it should be dropped
+static int request(int s)
+{
+    static struct request REQ[MAXRECORDS];
+    static struct mem_op OPS[MAXRECORDS];
+    static uint64_t DATA[MAXRECORDS];
+
+    uint32_t header[2];
+    if (!transfer(s, header, sizeof(header), 0)) return 0;
+    uint32_t records = le32toh(header[0]), status = 0;
+    if (records > MAXRECORDS || !transfer(s, REQ, records * sizeof(struct request), 0)) return 0;
+
+    for (uint32_t r = 0; r < records; r++)
+        OPS[r] = (struct mem_op){ .opcode = REQ[r].operator, .width = REQ[r].width, .flags = REQ[r].flags,
+                                  .address = le64toh(REQ[r].address), .data = le64toh(REQ[r].data) };
+    uint32_t done = mem_submit(M, OPS, records);
+    if (done < records) status = done + 1;
+    for (uint32_t r = 0; r < records; r++) DATA[r] = (r < done) ? htole64(OPS[r].result) : 0;
+
+    header[0] = htole32(status);
+    header[1] = htole32(records);
+    return transfer(s, header, sizeof(header), 1) && transfer(s, DATA, records * sizeof(uint64_t), 1);
+}
+
+// Listen on a Unix socket path or TCP [host]:port and serve requests from any number of clients, one
+// message at a time
+static void serve(char *name)
+{
+    int s;
+    if (strchr(name, '/'))
+    {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(name) >= sizeof(sun.sun_path)) die("Socket path %s is too long\n", name);
+        strcpy(sun.sun_path, name);
+        unlink(name);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s < 0 || bind(s, (struct sockaddr *)&sun, sizeof(sun))) die("Can't bind %s: %s\n", name, strerror(errno));
+    }
+    else
+    {
+        char *port = strrchr(name, ':'), host[256];
+        if (!port || port - name >= sizeof(host)) die("'%s' is not a socket path or [host]:port\n", name);
+        sprintf(host, "%.*s", (int)(port - name), name);
+        // without a host, only 127.0.0.1, since clients get unauthenticated access to memory
+        struct addrinfo *ai, hints = { .ai_family = *host ? AF_UNSPEC : AF_INET, .ai_socktype = SOCK_STREAM };
+        int e = getaddrinfo(*host ? host : NULL, port + 1, &hints, &ai);
+        if (e) die("Can't resolve %s: %s\n", name, gai_strerror(e));
+        s = socket(ai->ai_family, SOCK_STREAM, 0);
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+        if (s < 0 || bind(s, ai->ai_addr, ai->ai_addrlen)) die("Can't bind %s: %s\n", name, strerror(errno));
+        freeaddrinfo(ai);
+    }
+    if (listen(s, 16)) die("Can't listen on %s: %s\n", name, strerror(errno));
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[1 + MAXCLIENTS] = {{ .fd = s, .events = POLLIN }};
+    int clients = 0;
+    while (1)
+    {
+        if (poll(fds, 1 + clients, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            die("Poll failed: %s\n", strerror(errno));
+        }
+
+        for (int c = 1; c <= clients; c++)
+            if (fds[c].revents && ((fds[c].revents & (POLLERR|POLLNVAL)) || !request(fds[c].fd)))
+            {
+                close(fds[c].fd);
+                fds[c--] = fds[clients--];
+            }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int c = accept(s, NULL, NULL);
+            if (c < 0) continue;
+            if (clients == MAXCLIENTS) close(c);
+            else
+            {
+                struct timeval t = { .tv_sec = CLIENTTIMEOUT };
+                setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+                setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+                setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+                fds[++clients] = (struct pollfd){ .fd = c, .events = POLLIN };
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    char *file = NULL, *server = NULL;
+    int lines = 0;
+    static const struct option LONG[] = { { "stats", no_argument, NULL, 256 }, { 0 } };
+    while (1) switch (getopt_long(argc, argv, "+c:D:df:j:L:lm:nr:S:s:t:z", LONG, NULL))
+    {
+        case 256: stats = 1; break;
+        case 'D': device = optarg; break;
+        case 'd': changes = 1; break;
+        case 'c': samples = strtoull(optarg, NULL, 0); break;
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'L': server = optarg; break;
+        case 'j': jobs = strtoul(optarg, NULL, 0); break;
+        case 'm': mismatches = strtoull(optarg, NULL, 0); break;
+        case 'n': numa = 1; break;
+        case 'f': file = optarg; break;
+        case 'l': lines = 1; break;
+        case 'S': capture = optarg; break;
+        case 's': spins = strtoul(optarg, NULL, 0); break;
+        case 't': timeout = strtoul(optarg, NULL, 0); break;
+        case 'z': compress = 1; break;
+        case -1: goto optx;
+        default: usage();
+    }
+    optx:
+
+    // Operations are parsed twice, first to make sure they're all valid before touching memory, then
+    // again to perform them one at a time. So there is no limit on the number of operations. Only the
+    // second pass is tallied for --stats.
+    struct op op;
+    int ops = 0;
+    for (int x = optind; x < argc; x++) ops += parsing(argv[x], &op);
+
+    if (!ops && !file && !server) usage();
+    if (rate && (!ops || file || server)) die("-r only samples command line operations\n");
+    if (rate && capture) die("-r can't be used with -S\n");
+    if (batch && !file) die("Unterminated '['\n");
+    if (grouping && !file) die("Unterminated '{'\n");
+
+    // perform
+    atexit(finish);
+
+    TIMED(PHASE[OPENING], M = mem_open(device));
+    if (!M) die("Can't open %s: %s\n", device ?: "/dev/mem", strerror(errno));
+
+    width = 32, swap = 0, raw = 0, cached = 0, batch = 0, grouping = 0;
+    if (rate)
+    {
+        struct op *sampled = malloc(ops * sizeof(struct op));
+        if (!sampled) die("Out of memory\n");
+        for (int x = optind, n = 0; x < argc; x++) n += parse(argv[x], &sampled[n]);
+        sample(sampled, ops);
+        free(sampled);
+    }
+    else for (int x = optind; x < argc; x++) if (parse(argv[x], &op)) execute(&op);
+
+    if (file) script(file, lines);
+    join();
+
+    if (server)
+    {
+        flush();
+        serve(server);
+    }
+
     return 0;
 }